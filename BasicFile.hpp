@@ -3,9 +3,17 @@
 #include <vector>
 #include <fstream>
 #include <memory>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/filesystem.hpp>
+#include <zstd.h>
+#include "utils.h"
+#include "BufferPool.hpp"
 
 
 enum FileOrigin
@@ -20,6 +28,9 @@ class BlockBase
 {
 public:
     BlockBase() : references(0) {}
+    //a copy is a new object, nobody holds a reference to it yet
+    BlockBase(const BlockBase &) : references(0) {}
+    BlockBase &operator=(const BlockBase &) { return *this; }
     virtual ~BlockBase() {}
     //virtual get method
     virtual void Read(void *data, size_t offset, size_t size) = 0;
@@ -34,10 +45,17 @@ public:
     template <typename T>
     std::unique_ptr<T[]> Get(size_t offset, size_t count)
     {
-        auto size = count*sizeof(T);
-        std::unique_ptr<T[]> result = std::make_unique<T[]>(size);
+        //default initialized: the read overwrites every element anyway
+        std::unique_ptr<T[]> result(new T[count]);
         Get(result.get(), offset, count);
-        return std::move(result);
+        return result;
+    }
+    //read into an uninitialized pooled buffer
+    Buffer ReadBuffer(size_t offset, size_t size)
+    {
+        Buffer result = AllocateBuffer(size);
+        Read(result.get(), offset, size);
+        return result;
     }
     template <typename T>
     void Get(T *result, size_t offset, size_t count)
@@ -47,7 +65,21 @@ public:
     }
     //size of block
     virtual size_t Size() = 0;
-    size_t references;
+    //direct pointer to the block bytes, nullptr if the block is not memory resident
+    virtual const unsigned char *Data()
+    {
+        return nullptr;
+    }
+    //hint that the range will be read soon
+    virtual void WillNeed(size_t offset, size_t size)
+    {
+    }
+    //file the block bytes are read from, offset becomes the position in it. nullptr if there is none
+    virtual InputFile *SourceFile(size_t &offset)
+    {
+        return nullptr;
+    }
+    std::atomic<size_t> references;
 };
 
 
@@ -70,7 +102,7 @@ typedef boost::intrusive_ptr<BlockBase> BlockPtr;
 class BlockDisk : public BlockBase
 {
 public:
-    BlockDisk(const wchar_t *fileName)
+    BlockDisk(const PathChar *fileName)
         : fileName_(fileName)
     {
         Open();
@@ -111,7 +143,7 @@ private:
     {
         file.close();
     }
-    std::wstring fileName_;
+    PathString fileName_;
     std::ifstream  file;
     size_t fileSize;
 };
@@ -122,17 +154,21 @@ public:
     BlockMemory(const BlockPtr &file)
         :blockSize(file->Size())
     {
-        blockData = std::make_unique<unsigned char[]>(blockSize);
+        blockData = AllocateBuffer(blockSize);
         file->Get(blockData.get(), 0, blockSize);
     }
     BlockMemory(std::unique_ptr<unsigned char[]>  &&data, size_t size)
+        :blockSize(size), blockData(data.release(), BufferDeleter{ -1 })
+    {
+    }
+    BlockMemory(Buffer &&data, size_t size)
         :blockSize(size), blockData(std::move(data))
     {
     }
     BlockMemory(const void *data, size_t size)
         :blockSize(size)
     {
-        blockData = std::make_unique<unsigned char[]>(size);
+        blockData = AllocateBuffer(size);
         std::memcpy(blockData.get(), data, size);
     }
     virtual void Read(void *data, size_t offset, size_t size) override
@@ -145,9 +181,167 @@ public:
     {
         return blockSize;
     }
+    virtual const unsigned char *Data() override
+    {
+        return blockData.get();
+    }
 private:
-    std::unique_ptr<unsigned char[]> blockData;
+    Buffer blockData;
+    size_t blockSize;
+};
+
+class BlockFile : public BlockBase
+{
+public:
+    BlockFile(const PathChar *fileName)
+        : file(fileName)
+    {
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        file.ReadAt(data, offset, size);
+    }
+    virtual size_t Size() override
+    {
+        return size_t(file.Size());
+    }
+    virtual void WillNeed(size_t offset, size_t size) override
+    {
+        file.WillNeed(offset, size);
+    }
+    virtual InputFile *SourceFile(size_t &offset) override
+    {
+        return &file;
+    }
+private:
+    InputFile file;
+};
+
+class BlockMapped : public BlockBase
+{
+public:
+    BlockMapped(const PathChar *fileName)
+        : mapped(fileName)
+    {
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        if (offset + size > mapped.Size())
+            throw std::runtime_error("Going beyond file");
+        std::memcpy(data, mapped.Data() + offset, size);
+    }
+    virtual size_t Size() override
+    {
+        return size_t(mapped.Size());
+    }
+    virtual const unsigned char *Data() override
+    {
+        return mapped.Data();
+    }
+private:
+    MappedFile mapped;
+};
+
+//zstd stream decompressed on demand: a read only waits for the prefix it touches.
+//Reads may come from several threads, one of them decompresses while the others wait for it.
+class BlockZstdStream : public BlockBase
+{
+public:
+    BlockZstdStream(BlockPtr source, size_t decompressedSize)
+        : source_(source)
+        , sourceOffset_(0)
+        , blockSize(decompressedSize)
+        , produced_(0)
+        , blockData(new unsigned char[decompressedSize])
+        , stream_(ZSTD_createDStream())
+    {
+        if (!stream_)
+            throw std::runtime_error("Cannot create zstd stream");
+        ZSTD_initDStream(stream_);
+        input_.src = nullptr;
+        input_.size = 0;
+        input_.pos = 0;
+    }
+    virtual ~BlockZstdStream()
+    {
+        ZSTD_freeDStream(stream_);
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        if (offset + size > blockSize)
+            throw std::runtime_error("Memory file index out of range");
+        if (offset + size > produced_.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Decompress(offset + size);
+        }
+        std::memcpy(data, blockData.get() + offset, size);
+    }
+    virtual size_t Size() override
+    {
+        return blockSize;
+    }
+    virtual const unsigned char *Data() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Decompress(blockSize);
+        return blockData.get();
+    }
+private:
+    static const size_t STEP_SIZE = 0x100000;
+
+    void Refill()
+    {
+        size_t remaining = source_->Size() - sourceOffset_;
+        if (remaining == 0)
+            throw std::runtime_error("Unexpected end of compressed data");
+
+        const unsigned char *sourceData = source_->Data();
+        if (sourceData)
+        {
+            // mapped or memory source: feed it to zstd without copying
+            input_.src = sourceData + sourceOffset_;
+            input_.size = remaining;
+        }
+        else
+        {
+            size_t size = std::min(remaining, ZSTD_DStreamInSize());
+            if (!inBuffer_)
+                inBuffer_.reset(new unsigned char[ZSTD_DStreamInSize()]);
+            source_->Read(inBuffer_.get(), sourceOffset_, size);
+            input_.src = inBuffer_.get();
+            input_.size = size;
+        }
+        input_.pos = 0;
+        sourceOffset_ += input_.size;
+    }
+    void Decompress(size_t until)
+    {
+        while (produced_ < until)
+        {
+            if (input_.pos == input_.size)
+                Refill();
+
+            ZSTD_outBuffer output;
+            output.dst = blockData.get();
+            output.size = std::min(blockSize, std::max(until, produced_ + STEP_SIZE));
+            output.pos = produced_;
+            size_t result = ZSTD_decompressStream(stream_, &output, &input_);
+            if (ZSTD_isError(result))
+                throw std::runtime_error(ZSTD_getErrorName(result));
+            produced_.store(output.pos, std::memory_order_release);
+        }
+    }
+
+    BlockPtr source_;
+    size_t sourceOffset_;
     size_t blockSize;
+    std::mutex mutex_;
+    std::atomic<size_t> produced_;
+    std::unique_ptr<unsigned char[]> blockData;
+    std::unique_ptr<unsigned char[]> inBuffer_;
+    ZSTD_DStream *stream_;
+    ZSTD_inBuffer input_;
 };
 
 class BlockPart : public BlockBase
@@ -157,7 +351,7 @@ public:
         : size_(size), offset_(offset), file_(file)
     {
         if (offset_ + size_ > file->Size())
-            throw std::exception("File create error: part file");
+            throw std::runtime_error("File create error: part file");
         BlockPart *sourceFile = dynamic_cast<BlockPart*>(file.get());
         if (sourceFile)
         {
@@ -168,13 +362,27 @@ public:
     virtual void Read(void *data, size_t offset, size_t size) override
     {
         if (offset + size > size_)
-            throw std::exception("File read error: part file");
+            throw std::runtime_error("File read error: part file");
         return file_->Read(data, offset + offset_, size);
     }
     virtual size_t Size() override
     {
         return size_;
     }
+    virtual const unsigned char *Data() override
+    {
+        const unsigned char *data = file_->Data();
+        return data ? data + offset_ : nullptr;
+    }
+    virtual void WillNeed(size_t offset, size_t size) override
+    {
+        file_->WillNeed(offset + offset_, size);
+    }
+    virtual InputFile *SourceFile(size_t &offset) override
+    {
+        offset += offset_;
+        return file_->SourceFile(offset);
+    }
 private:
     BlockPtr file_;
     size_t offset_;
@@ -188,7 +396,7 @@ BlockPtr MakeBlockPart(BlockPtr base, size_t offset, size_t size)
 BlockPtr MakeBlockPair(BlockPtr block1, BlockPtr block2)
 {
     size_t size = block1->Size() + block2->Size();
-    std::unique_ptr<unsigned char[]> data = std::make_unique<unsigned char[]>(size);
+    Buffer data = AllocateBuffer(size);
     block1->Get(data.get(), 0, block1->Size());
     block2->Get(data.get() + block1->Size(), 0, block2->Size());
     return BlockPtr(new BlockMemory(std::move(data), size));
@@ -210,14 +418,35 @@ BlockPtr MakeBlockMemory(std::unique_ptr<unsigned char[]>  &&data, size_t size)
 {
     return BlockPtr(new BlockMemory(std::move(data), size));
 }
-BlockPtr MakeBlockDisk(const wchar_t *filePath)
+BlockPtr MakeBlockMemory(Buffer &&data, size_t size)
+{
+    return BlockPtr(new BlockMemory(std::move(data), size));
+}
+BlockPtr MakeBlockDisk(const PathChar *filePath)
 {
     return BlockPtr(new BlockDisk(filePath));
 }
-BlockPtr MakeBlockDisk(const std::wstring &filePath)
+BlockPtr MakeBlockDisk(const PathString &filePath)
 {
     return MakeBlockDisk(filePath.c_str());
 }
+BlockPtr MakeBlockFile(const PathString &filePath)
+{
+    return BlockPtr(new BlockFile(filePath.c_str()));
+}
+BlockPtr MakeBlockMapped(const PathString &filePath)
+{
+    return BlockPtr(new BlockMapped(filePath.c_str()));
+}
+BlockPtr MakeBlockZstdStream(BlockPtr source, size_t decompressedSize)
+{
+    return BlockPtr(new BlockZstdStream(source, decompressedSize));
+}
+
+template <typename T>
+class DataArray;
+template <typename T>
+DataArray<T> ReadArray(BlockPtr block, size_t offset, size_t count);
 
 template <typename T>
 class DataArray
@@ -251,7 +480,7 @@ public:
         const T &dereference() const
         {
             if (iter < iterBegin || iter >= iterEnd)
-                throw std::exception("Index out of range");
+                throw std::runtime_error("Index out of range");
             return *iter;
         }
         bool equal(const Iterator &z) const
@@ -274,7 +503,7 @@ public:
         , data(std::move(block->Get<T>(offset, count)))
     {
     }
-    size_t Size()
+    size_t Size() const
     {
         return count;
     }
@@ -282,7 +511,7 @@ public:
     {
         //ERROR_STACK(index);
         if (index >= count)
-            throw std::exception("Array index out of range");
+            throw std::runtime_error("Array index out of range");
         return data[index];
     }
     Iterator begin() const
@@ -333,21 +562,21 @@ public:
         case FileOriginBegin:
         {
             if (newPosition > Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position = newPosition;
         }
         break;
         case FileOriginCurrent:
         {
             if (newPosition + position> Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position += newPosition;
         }
         break;
         case FileOriginEnd:
         {
             if (newPosition > Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position = Size() - newPosition;
         }
         break;
@@ -379,7 +608,7 @@ public:
     {
         size_t oldPos = position;
         if (size + position> Size())
-            throw std::exception("File part error: virtual file");
+            throw std::runtime_error("File part error: virtual file");
         position += size;
         return MakeBlockPart(block, oldPos, size);
     }
@@ -392,7 +621,7 @@ public:
     {
         size_t oldPosition = position;
         if (sizeof(T)*elementCount + position> Size())
-            throw std::exception("File part error: virtual file");
+            throw std::runtime_error("File part error: virtual file");
         position += sizeof(T)*elementCount;
         return ReadArray<T>(block, oldPosition, elementCount);
     }
@@ -410,30 +639,64 @@ private:
 };
 
 
-File MakeFileDisk(const wchar_t *filePath)
+File MakeFileDisk(const PathChar *filePath)
 {
     return File(MakeBlockDisk(filePath));
 }
-File MakeFileDisk(const std::wstring &filePath)
+File MakeFileDisk(const PathString &filePath)
 {
     return MakeFileDisk(filePath.c_str());
 }
+File MakeFileMapped(const PathString &filePath)
+{
+    return File(MakeBlockMapped(filePath));
+}
 
-void WriteBlock(BlockPtr block, const wchar_t *filePath)
+void WriteBlocks(const std::vector<BlockPtr> &blocks, const PathChar *filePath, bool append)
+{
+    OutputFile file(filePath, append);
+    std::vector<DataSpan> spans;
+    std::vector<Buffer> copies;
+    for (const BlockPtr &block : blocks)
+    {
+        const unsigned char *data = block->Data();
+        size_t sourceOffset = 0;
+        InputFile *source = data ? nullptr : block->SourceFile(sourceOffset);
+        if (source)
+        {
+            // bytes stored as is in a file are copied file to file, never through our buffers
+            file.Write(spans);
+            spans.clear();
+            file.CopyFrom(*source, sourceOffset, block->Size());
+            continue;
+        }
+        if (!data && block->Size())
+        {
+            // only blocks that aren't memory resident are read into a buffer
+            copies.push_back(block->ReadBuffer(0, block->Size()));
+            data = copies.back().get();
+        }
+        spans.push_back(DataSpan{ data, block->Size() });
+    }
+    file.Write(spans);
+}
+void WriteBlocks(const std::vector<BlockPtr> &blocks, const PathString &filePath, bool append)
+{
+    WriteBlocks(blocks, filePath.c_str(), append);
+}
+void WriteBlock(BlockPtr block, const PathChar *filePath)
 {
-    std::ofstream file(filePath, std::ios::binary);
-    file.write(block->Get<char>(0, block->Size()).get(), block->Size());
+    WriteBlocks({ block }, filePath, false);
 }
-void WriteBlock(BlockPtr block, const std::wstring &filePath)
+void WriteBlock(BlockPtr block, const PathString &filePath)
 {
     WriteBlock(block, filePath.c_str());
 }
-void WriteBlockApp(BlockPtr block, const wchar_t *filePath)
+void WriteBlockApp(BlockPtr block, const PathChar *filePath)
 {
-    std::ofstream file(filePath, std::ios::binary | std::ios::app | std::ios::ate);
-    file.write(block->Get<char>(0, block->Size()).get(), block->Size());
+    WriteBlocks({ block }, filePath, true);
 }
-void WriteBlockApp(BlockPtr block, const std::wstring &filePath)
+void WriteBlockApp(BlockPtr block, const PathString &filePath)
 {
     WriteBlockApp(block, filePath.c_str());
 }
@@ -0,0 +1,244 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+
+struct BufferDeleter
+{
+    // -1 marks a plain heap buffer that doesn't belong to any size class
+    int sizeClass = -1;
+    void operator()(unsigned char *data) const;
+};
+
+typedef std::unique_ptr<unsigned char[], BufferDeleter> Buffer;
+
+
+// Size classed pool of uninitialized buffers. Small classes are cached per thread,
+// larger ones are shared, buffers beyond the largest class come from the heap.
+// Every free buffer kept, in a thread cache or a shared list, counts against the retain limit.
+class BufferPool
+{
+public:
+    static const int MIN_CLASS_SHIFT = 12; // 4 KiB
+    static const int MAX_CLASS_SHIFT = 28; // 256 MiB
+    static const int CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+    static const size_t THREAD_CACHE_MAX_SIZE = 0x100000;
+    static const size_t THREAD_CACHE_COUNT = 8;
+    static const size_t MAX_RETAINED_BYTES = 0x40000000;
+
+    static BufferPool &Instance()
+    {
+        // never destroyed: buffers held by globals may come back after static destruction began
+        static BufferPool *pool = new BufferPool();
+        return *pool;
+    }
+    static int SizeClass(size_t size)
+    {
+        for (int shift = MIN_CLASS_SHIFT; shift <= MAX_CLASS_SHIFT; shift++)
+        {
+            if (size <= (size_t(1) << shift))
+                return shift - MIN_CLASS_SHIFT;
+        }
+        return -1;
+    }
+    static size_t ClassSize(int sizeClass)
+    {
+        return size_t(1) << (sizeClass + MIN_CLASS_SHIFT);
+    }
+    //bytes a buffer of size really takes
+    static size_t AllocatedSize(size_t size)
+    {
+        int sizeClass = SizeClass(size);
+        return sizeClass < 0 ? size : ClassSize(sizeClass);
+    }
+    //cap on the free buffers kept, the shared ones beyond it are freed. The thread caches
+    //keep what they hold, so set it before the workers start
+    void SetRetainLimit(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        retainLimit = bytes;
+        for (int sizeClass = CLASS_COUNT - 1; sizeClass >= 0 && retainedBytes > retainLimit; sizeClass--)
+        {
+            std::vector<unsigned char*> &shared = buffers[sizeClass];
+            while (!shared.empty() && retainedBytes > retainLimit)
+            {
+                delete[] shared.back();
+                shared.pop_back();
+                retainedBytes -= ClassSize(sizeClass);
+            }
+        }
+    }
+
+    Buffer Allocate(size_t size)
+    {
+        int sizeClass = SizeClass(size);
+        if (sizeClass < 0)
+            return Buffer(new unsigned char[size], BufferDeleter{ -1 });
+
+        std::vector<unsigned char*> &local = LocalCache().buffers[sizeClass];
+        if (!local.empty())
+        {
+            unsigned char *data = local.back();
+            local.pop_back();
+            retainedBytes -= ClassSize(sizeClass);
+            return Buffer(data, BufferDeleter{ sizeClass });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<unsigned char*> &shared = buffers[sizeClass];
+            if (!shared.empty())
+            {
+                unsigned char *data = shared.back();
+                shared.pop_back();
+                retainedBytes -= ClassSize(sizeClass);
+                return Buffer(data, BufferDeleter{ sizeClass });
+            }
+        }
+        return Buffer(new unsigned char[ClassSize(sizeClass)], BufferDeleter{ sizeClass });
+    }
+    void Release(unsigned char *data, int sizeClass)
+    {
+        if (sizeClass < 0)
+        {
+            delete[] data;
+            return;
+        }
+        if (ClassSize(sizeClass) <= THREAD_CACHE_MAX_SIZE)
+        {
+            std::vector<unsigned char*> &local = LocalCache().buffers[sizeClass];
+            if (local.size() < THREAD_CACHE_COUNT && Retain(ClassSize(sizeClass)))
+            {
+                local.push_back(data);
+                return;
+            }
+        }
+        ReleaseShared(data, sizeClass);
+    }
+private:
+    struct ThreadCache
+    {
+        ~ThreadCache()
+        {
+            for (int sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++)
+            {
+                for (unsigned char *data : buffers[sizeClass])
+                {
+                    BufferPool::Instance().retainedBytes -= ClassSize(sizeClass);
+                    BufferPool::Instance().ReleaseShared(data, sizeClass);
+                }
+            }
+        }
+        std::vector<unsigned char*> buffers[CLASS_COUNT];
+    };
+
+    BufferPool()
+        : retainedBytes(0)
+        , retainLimit(MAX_RETAINED_BYTES)
+    {
+    }
+    static ThreadCache &LocalCache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+    //counts bytes as kept, false if that would go past the limit
+    bool Retain(size_t bytes)
+    {
+        if (retainedBytes.fetch_add(bytes) + bytes <= retainLimit)
+            return true;
+        retainedBytes -= bytes;
+        return false;
+    }
+    void ReleaseShared(unsigned char *data, int sizeClass)
+    {
+        if (Retain(ClassSize(sizeClass)))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers[sizeClass].push_back(data);
+            return;
+        }
+        delete[] data;
+    }
+
+    std::mutex mutex;
+    std::vector<unsigned char*> buffers[CLASS_COUNT];
+    std::atomic<size_t> retainedBytes;
+    std::atomic<size_t> retainLimit;
+};
+
+
+inline void BufferDeleter::operator()(unsigned char *data) const
+{
+    BufferPool::Instance().Release(data, sizeClass);
+}
+
+inline Buffer AllocateBuffer(size_t size)
+{
+    return BufferPool::Instance().Allocate(size);
+}
+
+
+// Byte budget for buffers in flight, a semaphore counted in bytes: a reservation waits
+// until that many bytes are free. Reservations larger than the whole budget take all of it.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(uint64_t limit)
+        : limit(limit)
+        , used(0)
+    {
+    }
+    uint64_t Limit() const
+    {
+        return limit;
+    }
+    // holds bytes of the budget for its lifetime, does nothing without a budget
+    class Reservation
+    {
+    public:
+        Reservation(MemoryBudget *budget, uint64_t bytes)
+            : budget(budget)
+            , bytes(0)
+        {
+            if (budget)
+                this->bytes = budget->Acquire(bytes);
+        }
+        ~Reservation()
+        {
+            if (budget)
+                budget->Release(bytes);
+        }
+    private:
+        Reservation(const Reservation &) = delete;
+        Reservation &operator=(const Reservation &) = delete;
+        MemoryBudget *budget;
+        uint64_t bytes;
+    };
+private:
+    uint64_t Acquire(uint64_t bytes)
+    {
+        bytes = std::min(bytes, limit);
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [this, bytes] { return used + bytes <= limit; });
+        used += bytes;
+        return bytes;
+    }
+    void Release(uint64_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+        }
+        released.notify_all();
+    }
+
+    uint64_t limit;
+    uint64_t used;
+    std::mutex mutex;
+    std::condition_variable released;
+};
@@ -0,0 +1,245 @@
+#pragma once
+#include "SdfArchive.hpp"
+#include "Extractor.hpp"
+#include <queue>
+
+
+struct WorkItem
+{
+    size_t archiveIndex;
+    const SdfArchive *archive;
+    const SdfAsset *asset;
+};
+
+// the first chunk decides where an asset sits, the rest of its chunks follow it
+inline bool DiskOrderLess(const WorkItem &a, const WorkItem &b)
+{
+    if (a.archiveIndex != b.archiveIndex)
+        return a.archiveIndex < b.archiveIndex;
+    if (a.asset->chunks.empty() || b.asset->chunks.empty())
+        return a.asset->chunks.size() < b.asset->chunks.size();
+    const SdfChunk &chunkA = a.asset->chunks[0];
+    const SdfChunk &chunkB = b.asset->chunks[0];
+    if (chunkA.packageId != chunkB.packageId)
+        return chunkA.packageId < chunkB.packageId;
+    return chunkA.packageOffset < chunkB.packageOffset;
+}
+
+// Sort by (package, offset) so every package is read front to back
+inline void SortByDiskOrder(std::vector<WorkItem> &items)
+{
+    std::stable_sort(items.begin(), items.end(), DiskOrderLess);
+}
+
+
+// Items of shard (0 based) out of shardCount, in their original order. Assets writing the same file
+// stay together so no file is written by two nodes, and the groups go largest first to the shard with the
+// fewest decompressed bytes. Only the parsed tocs decide the split, every node given the same
+// tocs in the same order agrees on it.
+inline std::vector<WorkItem> SelectShard(const std::vector<WorkItem> &items, size_t shard, size_t shardCount)
+{
+    struct Group
+    {
+        uint64_t bytes;
+        std::vector<size_t> members;
+    };
+    std::vector<Group> groups;
+    std::unordered_map<std::string, size_t> groupByName;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        auto it = groupByName.emplace(items[i].asset->name, groups.size()).first;
+        if (it->second == groups.size())
+            groups.push_back(Group{ 0, {} });
+        groups[it->second].bytes += items[i].asset->DecompressedSize();
+        groups[it->second].members.push_back(i);
+    }
+
+    std::vector<size_t> order(groups.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&groups](size_t a, size_t b) { return groups[a].bytes > groups[b].bytes; });
+
+    // (load, shard), the least loaded and then the lowest shard on top
+    typedef std::pair<uint64_t, size_t> Load;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (size_t i = 0; i < shardCount; i++)
+        loads.push(Load(0, i));
+
+    std::vector<bool> selected(items.size(), false);
+    for (size_t groupIndex : order)
+    {
+        Load load = loads.top();
+        loads.pop();
+        if (load.second == shard)
+        {
+            for (size_t member : groups[groupIndex].members)
+                selected[member] = true;
+        }
+        load.first += groups[groupIndex].bytes;
+        loads.push(load);
+    }
+
+    std::vector<WorkItem> result;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (selected[i])
+            result.push_back(items[i]);
+    }
+    return result;
+}
+
+
+// Neighbouring items of one package fetched with a single read
+struct ReadGroup
+{
+    size_t first;
+    size_t count;
+    bool coalescable;
+    size_t archiveIndex;
+    uint16_t packageId;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// package range covering every chunk of the item, false if the chunks span several packages
+inline bool ItemRange(const WorkItem &item, uint16_t &packageId, uint64_t &begin, uint64_t &end)
+{
+    const std::vector<SdfChunk> &chunks = item.asset->chunks;
+    if (chunks.empty())
+        return false;
+    packageId = chunks[0].packageId;
+    begin = chunks[0].packageOffset;
+    end = begin;
+    for (const SdfChunk &chunk : chunks)
+    {
+        if (chunk.packageId != packageId)
+            return false;
+        begin = std::min(begin, chunk.packageOffset);
+        end = std::max(end, chunk.packageOffset + chunk.StoredSize());
+    }
+    return true;
+}
+
+// true if none of the item's bytes need decompressing: it is copied file to file and a window would only add a copy
+inline bool StoredRaw(const WorkItem &item)
+{
+    for (const SdfChunk &chunk : item.asset->chunks)
+    {
+        if (!chunk.hasCompression)
+            continue;
+        if (chunk.compSizeArray.size() == 1)
+            return false;
+        uint64_t MySize = chunk.decompressedSize;
+        for (uint64_t compSizePart : chunk.compSizeArray)
+        {
+            uint64_t chunkSize = std::min<uint64_t>(MySize, CHUNK_SIZE);
+            if (compSizePart != 0 && compSizePart < chunkSize)
+                return false;
+            MySize -= chunkSize;
+        }
+    }
+    return true;
+}
+
+// Merge disk ordered items whose ranges are at most maxGap apart into reads of at most maxSpan bytes.
+// The bytes in the gaps are read and thrown away, which is cheaper than another request.
+// Items stored raw are left alone, they never pass through memory.
+inline std::vector<ReadGroup> CoalesceReads(const std::vector<WorkItem> &items, uint64_t maxGap, uint64_t maxSpan)
+{
+    std::vector<ReadGroup> groups;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        uint16_t packageId = 0;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+        bool coalescable = maxSpan != 0 && ItemRange(items[i], packageId, begin, end) && end - begin <= maxSpan &&
+            !StoredRaw(items[i]);
+        if (coalescable && !groups.empty())
+        {
+            ReadGroup &last = groups.back();
+            if (last.coalescable && last.archiveIndex == items[i].archiveIndex && last.packageId == packageId &&
+                begin >= last.begin && begin <= last.end + maxGap && std::max(end, last.end) - last.begin <= maxSpan)
+            {
+                last.count++;
+                last.end = std::max(end, last.end);
+                continue;
+            }
+        }
+        groups.push_back(ReadGroup{ i, 1, coalescable, items[i].archiveIndex, packageId, begin, end });
+    }
+    return groups;
+}
+
+
+// Keeps readahead hints a fixed number of bytes ahead of the item workers are on.
+// Adjacent ranges of one package are merged into a single hint.
+class Readahead
+{
+public:
+    Readahead(PackageCache &packages, const std::vector<WorkItem> &items, uint64_t windowBytes)
+        : packages(packages)
+        , items(items)
+        , windowBytes(windowBytes)
+        , hinted(0)
+        , storedBytes(items.size() + 1, 0)
+    {
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            uint64_t itemBytes = 0;
+            for (const SdfChunk &chunk : items[i].asset->chunks)
+                itemBytes += chunk.StoredSize();
+            storedBytes[i + 1] = storedBytes[i] + itemBytes;
+        }
+    }
+    //a worker picked up item index, hint what follows it
+    void Started(size_t index)
+    {
+        if (windowBytes == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        hinted = std::max(hinted, index + 1);
+        Range range = {};
+        while (hinted < items.size() && storedBytes[hinted] - storedBytes[index + 1] < windowBytes)
+        {
+            const WorkItem &item = items[hinted++];
+            for (const SdfChunk &chunk : item.asset->chunks)
+            {
+                BlockPtr fileBlock = packages.Open(item.archive->PackagePath(chunk.packageId));
+                if (!fileBlock)
+                    continue;
+                uint64_t end = chunk.packageOffset + chunk.StoredSize();
+                if (range.block == fileBlock && chunk.packageOffset >= range.begin && chunk.packageOffset <= range.end)
+                {
+                    range.end = std::max(range.end, end);
+                    continue;
+                }
+                Flush(range);
+                range.block = fileBlock;
+                range.begin = chunk.packageOffset;
+                range.end = end;
+            }
+        }
+        Flush(range);
+    }
+private:
+    struct Range
+    {
+        BlockPtr block;
+        uint64_t begin;
+        uint64_t end;
+    };
+    void Flush(Range &range)
+    {
+        if (range.block && range.end <= range.block->Size())
+            range.block->WillNeed(size_t(range.begin), size_t(range.end - range.begin));
+        range.block = nullptr;
+    }
+
+    PackageCache &packages;
+    const std::vector<WorkItem> &items;
+    uint64_t windowBytes;
+    std::mutex mutex;
+    size_t hinted;
+    std::vector<uint64_t> storedBytes;
+};
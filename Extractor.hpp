@@ -0,0 +1,535 @@
+#pragma once
+#include "SdfArchive.hpp"
+#include "IoTuner.hpp"
+#include "Journal.hpp"
+#include "utils.h"
+#include <zstd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+
+// Fixed set of threads draining one task queue. Tasks may submit more tasks.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(size_t threadCount)
+        : active(0)
+        , stopping(false)
+    {
+        for (size_t i = 0; i < std::max<size_t>(threadCount, 1); i++)
+        {
+            threads.emplace_back([this] { Run(); });
+        }
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskReady.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+    size_t ThreadCount() const
+    {
+        return threads.size();
+    }
+    void Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        taskReady.notify_one();
+    }
+    //wait until the queue is drained and no task is running
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return tasks.empty() && active == 0; });
+    }
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            taskReady.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            active++;
+            lock.unlock();
+            try
+            {
+                task();
+            }
+            catch (const std::exception &ex)
+            {
+                PrintLine(std::string("!!!Error: ") + ex.what());
+            }
+            lock.lock();
+            active--;
+            if (tasks.empty() && active == 0)
+                idle.notify_all();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> tasks;
+    size_t active;
+    bool stopping;
+    std::vector<std::thread> threads;
+};
+
+
+// Package handles shared by every archive and worker, opened once on first use
+class PackageCache
+{
+public:
+    //nullptr for missing and 'Dummy' packages
+    BlockPtr Open(const PathString &sdfDataPath)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = packages.find(sdfDataPath);
+        if (it != packages.end())
+            return it->second;
+
+        BlockPtr fileBlock = nullptr;
+        if (!IsFileExist(sdfDataPath))
+        {
+            PrintLine(PATH_TEXT("!!!Error: Can't open the file: ") + sdfDataPath);
+        }
+        else
+        {
+            fileBlock = MakeBlockFile(sdfDataPath);
+            if (fileBlock->Size() <= 5)
+            {
+                // Skip 'Dummy' file
+                fileBlock = nullptr;
+            }
+            else
+            {
+                PrintLine(PATH_TEXT("Open file: ") + sdfDataPath);
+            }
+        }
+        packages[sdfDataPath] = fileBlock;
+        return fileBlock;
+    }
+private:
+    std::mutex mutex;
+    std::unordered_map<PathString, BlockPtr> packages;
+};
+
+
+class Extractor
+{
+public:
+    //package reads and output writes take a slot of the tuner's stages, if there is one.
+    //buffers are reserved from memory before they are allocated, if there is a budget.
+    //assets the journal has are skipped, the ones finished are added to it
+    Extractor(PackageCache &packages, const PathString &outputDir, IoTuner *tuner = nullptr, MemoryBudget *memory = nullptr,
+        Journal *journal = nullptr)
+        : packages(packages)
+        , outputDir(outputDir)
+        , tuner(tuner)
+        , memory(memory)
+        , journal(journal)
+        , extractedAssets(0)
+        , skippedAssets(0)
+        , extractedBytes(0)
+    {
+    }
+    //takes the asset's output name, false and reported if an asset claimed it before.
+    //Call it in toc and asset order before queuing, so the same asset wins however the workers run
+    bool Claim(const SdfAsset &asset)
+    {
+        PathString outFileName = outputDir + NativePath(asset.name);
+        {
+            std::lock_guard<std::mutex> lock(claimMutex);
+            if (claimed.insert(outFileName).second)
+                return true;
+        }
+        PrintLine(PATH_TEXT("!!!Error: File is exist: ") + outFileName);
+        return false;
+    }
+    //dump every chunk of the asset in order, the first one creates the file. Only claimed assets may be extracted.
+    //window holds the package bytes from windowOffset on, chunks inside it are sliced out of it.
+    //With a window the caller reserves the window and PlannedBytes of its assets itself.
+    //false if the asset was skipped or failed, errors are reported and never thrown
+    bool Extract(const SdfArchive &archive, const SdfAsset &asset, const BlockPtr &window = nullptr, uint64_t windowOffset = 0)
+    {
+        PathString outFileName = outputDir + NativePath(asset.name);
+        if (journal && journal->Done(archive, asset))
+        {
+            // finished by an earlier run
+            skippedAssets++;
+            return true;
+        }
+
+        // Don't override exist file. With a journal a file it doesn't list is left from an interrupted run
+        if (!journal && IsFileExist(outFileName))
+        {
+            PrintLine(PATH_TEXT("!!!Error: File is exist: ") + outFileName);
+            return false;
+        }
+
+        // the chunks go to a temporary file that gets the real name once it is complete
+        PathString partName = outFileName + PATH_TEXT(".partial");
+        bool dumped = true;
+        try
+        {
+            for (size_t chunkIndex = 0; chunkIndex < asset.chunks.size() && dumped; chunkIndex++)
+            {
+                bool append = chunkIndex != 0;
+                bool useDDS = asset.hasDdsHeader && chunkIndex == 0;
+                dumped = DumpFile(archive, asset, asset.chunks[chunkIndex], outFileName, partName, append, useDDS, window, windowOffset);
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            // a broken asset fails alone, the caller goes on with the next one
+            PrintLine(PATH_TEXT("!!!Error: Cannot extract file: ") + outFileName);
+            PrintLine(std::string("!!!Error: ") + ex.what() + "!!!");
+            dumped = false;
+        }
+        if (!dumped)
+        {
+            // whatever chunks made it out are of no use
+            boost::system::error_code error;
+            boost::filesystem::remove(partName, error);
+            return false;
+        }
+        if (!asset.chunks.empty())
+        {
+            boost::system::error_code error;
+            try
+            {
+                if (journal && !journal->SyncsFileSystem())
+                    OutputFile(partName, true).Sync();
+            }
+            catch (const std::exception& ex)
+            {
+                PrintLine(std::string("!!!Error: ") + ex.what() + "!!!");
+                error = boost::system::errc::make_error_code(boost::system::errc::io_error);
+            }
+            if (!error)
+                boost::filesystem::rename(partName, outFileName, error);
+            if (error)
+            {
+                PrintLine(PATH_TEXT("!!!Error: Cannot complete file: ") + outFileName);
+                boost::filesystem::remove(partName, error);
+                return false;
+            }
+        }
+        if (journal)
+            journal->Complete(archive, asset);
+        extractedAssets++;
+        return true;
+    }
+    //most memory one chunk of the asset holds while it is extracted
+    uint64_t PlannedBytes(const SdfAsset &asset) const
+    {
+        uint64_t bytes = 0;
+        for (const SdfChunk &chunk : asset.chunks)
+            bytes = std::max(bytes, ChunkBytes(chunk));
+        return bytes;
+    }
+    uint64_t ExtractedAssets() const
+    {
+        return extractedAssets;
+    }
+    //assets the journal listed as finished
+    uint64_t SkippedAssets() const
+    {
+        return skippedAssets;
+    }
+    uint64_t ExtractedBytes() const
+    {
+        return extractedBytes;
+    }
+private:
+    static const size_t STREAM_BUFFER_SIZE = 0x400000;
+
+    //chunks too big for a quarter of the budget are written page by page through a fixed buffer
+    bool Streamed(const SdfChunk &chunk) const
+    {
+        return memory && chunk.hasCompression && chunk.compSizeArray.size() > 1 &&
+            BufferPool::AllocatedSize(chunk.decompressedSize) > memory->Limit() / 4;
+    }
+    //the stream buffer fits in a quarter of the budget as well, but always holds one page
+    size_t StreamBufferSize() const
+    {
+        size_t size = STREAM_BUFFER_SIZE;
+        while (size > CHUNK_SIZE && size > memory->Limit() / 4)
+            size /= 2;
+        return size;
+    }
+    //uncompressed chunks are copied file to file and need no buffer
+    uint64_t ChunkBytes(const SdfChunk &chunk) const
+    {
+        if (!chunk.hasCompression)
+            return 0;
+        if (Streamed(chunk))
+            return StreamBufferSize() + CHUNK_SIZE;
+        uint64_t largestPage = chunk.compSizeArray.size() == 1 ? chunk.compSizeArray[0] : CHUNK_SIZE;
+        return BufferPool::AllocatedSize(chunk.decompressedSize) + BufferPool::AllocatedSize(largestPage);
+    }
+    Buffer ReadPackage(const BlockPtr &fileBlock, uint64_t offset, size_t size, IoTuner *readTuner)
+    {
+        IoTuner::Slot read(readTuner, IoTuner::Reads, size);
+        return fileBlock->ReadBuffer(offset, size);
+    }
+    bool DumpFile(const SdfArchive &archive, const SdfAsset &asset, const SdfChunk &chunk, const PathString &outFileName,
+        const PathString &partName, bool append, bool useDDS, const BlockPtr &window, uint64_t windowOffset)
+    {
+        // raw bytes always come from the package, only a file can be copied by the kernel
+        BlockPtr packageBlock = packages.Open(archive.PackagePath(chunk.packageId));
+        if (!packageBlock)
+            return false;
+        BlockPtr fileBlock = packageBlock;
+        IoTuner *readTuner = tuner;
+        uint64_t packageOffset = chunk.packageOffset;
+        uint64_t storedSize = chunk.StoredSize();
+        if (window && packageOffset >= windowOffset && packageOffset + storedSize <= windowOffset + window->Size())
+        {
+            fileBlock = MakeBlockPart(window, packageOffset - windowOffset, storedSize);
+            packageOffset = 0;
+            readTuner = nullptr;
+        }
+
+        CreateDirectoryRecursively(ExtractFilePath(outFileName));
+        PathString strExtract = append ? PATH_TEXT("+++++++ asset: ") : PATH_TEXT("Extract asset: ");
+        PrintLine(strExtract + outFileName);
+
+        MemoryBudget::Reservation reservation(window ? nullptr : memory, ChunkBytes(chunk));
+        if (Streamed(chunk))
+            return StreamFile(archive, asset, chunk, fileBlock, packageOffset, packageBlock, append, useDDS, partName, readTuner);
+
+        uint64_t decompressedSize = chunk.decompressedSize;
+        const std::vector<uint64_t> &compSizeArray = chunk.compSizeArray;
+
+        std::vector<BlockPtr> outputBlocks;
+        if (useDDS)
+        {
+            // the header goes out in the same write as the payload, the payload is never copied
+            SdfDdsHeader ddsHeader = archive.DdsHeader(asset.ddsType);
+            if (ddsHeader.usedBytes > sizeof(ddsHeader.bytes))
+            {
+                PrintLine("!!!Error: Broken dds header!!!");
+                return false;
+            }
+            outputBlocks.push_back(MakeBlockMemory(ddsHeader.bytes, ddsHeader.usedBytes));
+        }
+
+        if (!chunk.hasCompression)
+        {
+            // uncompressed data, copied from the package by the kernel
+            try
+            {
+                outputBlocks.push_back(MakeBlockPart(packageBlock, chunk.packageOffset, decompressedSize));
+            }
+            catch (const std::exception& ex)
+            {
+                PrintLine(std::string("!!!Error: call MakeBlockPart. Exception: ") + ex.what());
+                return false;
+            }
+        }
+        else
+        {
+            // need decompress
+            Buffer decompressed = AllocateBuffer(decompressedSize);
+            // runs of decompressed pages and raw pages left in the package, in file order
+            struct Piece
+            {
+                bool raw;
+                uint64_t offset;
+                uint64_t size;
+            };
+            std::vector<Piece> pieces;
+            if (compSizeArray.size() == 1)
+            {
+                size_t sizeCompressed = compSizeArray[0];
+                auto dataCompressed = ReadPackage(fileBlock, packageOffset, sizeCompressed, readTuner);
+                size_t dSize = ZSTD_decompress(decompressed.get(), decompressedSize, dataCompressed.get(), sizeCompressed);
+                if (dSize != decompressedSize)
+                {
+                    PrintLine("!!!Error: Uncompress error!!!");
+                    return false;
+                }
+                pieces.push_back(Piece{ false, 0, decompressedSize });
+            }
+            else
+            {
+                uint64_t decompOffset = 0;
+                uint64_t startOffset = packageOffset;
+                uint64_t MySize = decompressedSize;
+                size_t chunkSize = CHUNK_SIZE;
+                for (uint64_t compSizePart : compSizeArray)
+                {
+                    if (MySize < chunkSize)
+                    {
+                        chunkSize = MySize;
+                    }
+
+                    bool raw = compSizePart == 0 || compSizePart >= chunkSize;
+                    if (!raw)
+                    {
+                        auto dataCompressed = ReadPackage(fileBlock, packageOffset, compSizePart, readTuner);
+                        size_t dSize = ZSTD_decompress(decompressed.get() + decompOffset, chunkSize, dataCompressed.get(), compSizePart);
+                        if (dSize != chunkSize)
+                        {
+                            PrintLine("!!!Error: Uncompress error!!!");
+                            return false;
+                        }
+                    }
+
+                    // a raw page is not read here, it is copied from the package when the file is written
+                    uint64_t offset = raw ? chunk.packageOffset + packageOffset - startOffset : decompOffset;
+                    if (!pieces.empty() && pieces.back().raw == raw && pieces.back().offset + pieces.back().size == offset)
+                        pieces.back().size += chunkSize;
+                    else
+                        pieces.push_back(Piece{ raw, offset, chunkSize });
+                    packageOffset += raw ? chunkSize : compSizePart;
+                    decompOffset += chunkSize;
+                    MySize -= chunkSize;
+                }
+            }
+
+            BlockPtr decompressedBlock = MakeBlockMemory(std::move(decompressed), decompressedSize);
+            try
+            {
+                for (const Piece &piece : pieces)
+                    outputBlocks.push_back(MakeBlockPart(piece.raw ? packageBlock : decompressedBlock, piece.offset, piece.size));
+            }
+            catch (const std::exception& ex)
+            {
+                PrintLine(std::string("!!!Error: call MakeBlockPart. Exception: ") + ex.what());
+                return false;
+            }
+        }
+
+        try
+        {
+            uint64_t outputBytes = 0;
+            for (const BlockPtr &block : outputBlocks)
+                outputBytes += block->Size();
+            IoTuner::Slot write(tuner, IoTuner::Writes, outputBytes);
+            WriteBlocks(outputBlocks, partName, append);
+            extractedBytes += outputBytes;
+        }
+        catch (const std::exception& ex2)
+        {
+            PrintLine(std::string("!!!Error: ") + ex2.what() + "!!!");
+            return false;
+        }
+        return true;
+    }
+
+    //the decompressed pages gather in one buffer that is written whenever it is full,
+    //raw pages are copied from packageBlock in between
+    bool StreamFile(const SdfArchive &archive, const SdfAsset &asset, const SdfChunk &chunk, const BlockPtr &fileBlock,
+        uint64_t packageOffset, const BlockPtr &packageBlock, bool append, bool useDDS, const PathString &partName, IoTuner *readTuner)
+    {
+        uint64_t startOffset = packageOffset;
+        try
+        {
+            OutputFile output(partName, append);
+            size_t bufferSize = StreamBufferSize();
+            Buffer pending = AllocateBuffer(bufferSize);
+            size_t pendingSize = 0;
+            auto flush = [&]
+            {
+                if (!pendingSize)
+                    return;
+                IoTuner::Slot write(tuner, IoTuner::Writes, pendingSize);
+                output.Write({ DataSpan{ pending.get(), pendingSize } });
+                extractedBytes += pendingSize;
+                pendingSize = 0;
+            };
+            if (useDDS)
+            {
+                SdfDdsHeader ddsHeader = archive.DdsHeader(asset.ddsType);
+                if (ddsHeader.usedBytes > sizeof(ddsHeader.bytes))
+                {
+                    PrintLine("!!!Error: Broken dds header!!!");
+                    return false;
+                }
+                std::memcpy(pending.get(), ddsHeader.bytes, ddsHeader.usedBytes);
+                pendingSize = ddsHeader.usedBytes;
+            }
+
+            uint64_t MySize = chunk.decompressedSize;
+            size_t chunkSize = CHUNK_SIZE;
+            for (uint64_t compSizePart : chunk.compSizeArray)
+            {
+                if (MySize < chunkSize)
+                {
+                    chunkSize = MySize;
+                }
+                if (pendingSize + chunkSize > bufferSize)
+                    flush();
+
+                size_t sourceOffset = size_t(chunk.packageOffset + packageOffset - startOffset);
+                InputFile *source = packageBlock->SourceFile(sourceOffset);
+                if ((compSizePart == 0 || compSizePart >= chunkSize) && source)
+                {
+                    flush();
+                    IoTuner::Slot write(tuner, IoTuner::Writes, chunkSize);
+                    output.CopyFrom(*source, sourceOffset, chunkSize);
+                    extractedBytes += chunkSize;
+                    packageOffset += chunkSize;
+                }
+                else if (compSizePart == 0 || compSizePart >= chunkSize)
+                {
+                    fileBlock->Get<uint8_t>(pending.get() + pendingSize, size_t(packageOffset), chunkSize);
+                    pendingSize += chunkSize;
+                    packageOffset += chunkSize;
+                }
+                else
+                {
+                    auto dataCompressed = ReadPackage(fileBlock, packageOffset, compSizePart, readTuner);
+                    size_t dSize = ZSTD_decompress(pending.get() + pendingSize, chunkSize, dataCompressed.get(), compSizePart);
+                    if (dSize != chunkSize)
+                    {
+                        PrintLine("!!!Error: Uncompress error!!!");
+                        return false;
+                    }
+                    pendingSize += chunkSize;
+                    packageOffset += compSizePart;
+                }
+                MySize -= chunkSize;
+            }
+            flush();
+        }
+        catch (const std::exception& ex)
+        {
+            PrintLine(std::string("!!!Error: ") + ex.what() + "!!!");
+            return false;
+        }
+        return true;
+    }
+
+    PackageCache &packages;
+    PathString outputDir;
+    IoTuner *tuner;
+    MemoryBudget *memory;
+    Journal *journal;
+    std::mutex claimMutex;
+    std::unordered_set<PathString> claimed;
+    std::atomic<uint64_t> extractedAssets;
+    std::atomic<uint64_t> skippedAssets;
+    std::atomic<uint64_t> extractedBytes;
+};
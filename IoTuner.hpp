@@ -0,0 +1,261 @@
+#pragma once
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+
+// Counting semaphore whose limit may change while it is held
+class Gate
+{
+public:
+    explicit Gate(size_t limit)
+        : limit(limit)
+        , used(0)
+    {
+    }
+    void Acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return used < limit; });
+        used++;
+    }
+    void Release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used--;
+        }
+        ready.notify_one();
+    }
+    void SetLimit(size_t newLimit)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = newLimit;
+        }
+        ready.notify_all();
+    }
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    size_t limit;
+    size_t used;
+};
+
+
+// Limits package reads, extracting workers and output writes in flight and moves each limit
+// between its bounds while extraction runs. Every period the bytes moved are compared with the
+// period before: a step that helped is repeated, one that hurt is undone and, after a period to measure
+// the old limits again, the next limit is tried.
+class IoTuner
+{
+public:
+    enum Stage
+    {
+        Reads,
+        Workers,
+        Writes,
+        StageCount
+    };
+    struct Bounds
+    {
+        size_t min;
+        size_t max;
+    };
+
+    // holds one slot of the stage for its lifetime, bytes and time spent are accounted when it ends
+    class Slot
+    {
+    public:
+        Slot(IoTuner *tuner, Stage stage, uint64_t bytes = 0)
+            : tuner(tuner)
+            , stage(stage)
+            , bytes(bytes)
+        {
+            if (!tuner)
+                return;
+            tuner->stages[stage].gate.Acquire();
+            start = std::chrono::steady_clock::now();
+        }
+        ~Slot()
+        {
+            if (!tuner)
+                return;
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            StageState &state = tuner->stages[stage];
+            state.gate.Release();
+            state.bytes += bytes;
+            state.busyMicros += uint64_t(micros);
+            state.count++;
+        }
+    private:
+        Slot(const Slot &) = delete;
+        Slot &operator=(const Slot &) = delete;
+        IoTuner *tuner;
+        Stage stage;
+        uint64_t bytes;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    //adaptive false keeps every limit at its upper bound
+    IoTuner(const Bounds (&bounds)[StageCount], bool adaptive, std::chrono::milliseconds period = std::chrono::milliseconds(500))
+        : period(period)
+        , stopping(false)
+        , measured(false)
+        , knob(0)
+        , lastStep(0)
+        , lastRate(0)
+    {
+        for (size_t i = 0; i < StageCount; i++)
+        {
+            stages[i].bounds = bounds[i];
+            stages[i].bounds.min = std::max<size_t>(stages[i].bounds.min, 1);
+            stages[i].bounds.max = std::max(stages[i].bounds.max, stages[i].bounds.min);
+            // start at the upper bound and search down, a short run isn't throttled while the controller learns
+            stages[i].limit = stages[i].bounds.max;
+            stages[i].direction = -1;
+            stages[i].gate.SetLimit(stages[i].limit);
+        }
+        if (adaptive)
+            controller = std::thread([this] { Run(); });
+    }
+    ~IoTuner()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (controller.joinable())
+            controller.join();
+    }
+    //settings in the form the options take them, to pin them on the next run
+    std::string Settings() const
+    {
+        std::stringstream ss;
+        ss << "--tune-reads " << stages[Reads].limit << ":" << stages[Reads].limit
+            << " --tune-workers " << stages[Workers].limit << ":" << stages[Workers].limit
+            << " --tune-writes " << stages[Writes].limit << ":" << stages[Writes].limit;
+        return ss.str();
+    }
+private:
+    struct StageState
+    {
+        StageState()
+            : gate(1)
+            , bytes(0)
+            , busyMicros(0)
+            , count(0)
+        {
+        }
+        Gate gate;
+        Bounds bounds;
+        std::atomic<size_t> limit;
+        int direction;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> busyMicros;
+        std::atomic<uint64_t> count;
+    };
+
+    void Run()
+    {
+        uint64_t lastBytes[StageCount] = {};
+        uint64_t lastBusy[StageCount] = {};
+        uint64_t lastCount[StageCount] = {};
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, period, [this] { return stopping; }))
+        {
+            uint64_t moved = 0;
+            double latency[StageCount] = {};
+            for (size_t i = 0; i < StageCount; i++)
+            {
+                uint64_t bytes = stages[i].bytes;
+                uint64_t busy = stages[i].busyMicros;
+                uint64_t count = stages[i].count;
+                if (i != Workers)
+                    moved += bytes - lastBytes[i];
+                if (count != lastCount[i])
+                    latency[i] = double(busy - lastBusy[i]) / double(count - lastCount[i]) / 1000.0;
+                lastBytes[i] = bytes;
+                lastBusy[i] = busy;
+                lastCount[i] = count;
+            }
+            // nothing finished: parsing or a long write, there is nothing to learn from this period
+            if (moved == 0)
+                continue;
+
+            double rate = moved / 1048576.0 / std::chrono::duration<double>(period).count();
+            Step(rate);
+            measured = true;
+
+            std::stringstream ss;
+            ss << "Autotune: " << rate << " MiB/s, read " << latency[Reads] << " ms, write " << latency[Writes]
+                << " ms -> reads " << stages[Reads].limit << ", workers " << stages[Workers].limit << ", writes " << stages[Writes].limit;
+            PrintLine(ss.str());
+        }
+        // without a measured period the limits are still the starting ones, not a result
+        if (measured)
+            PrintLine("Autotune settled on " + Settings());
+    }
+    void Step(double rate)
+    {
+        if (lastStep != 0)
+        {
+            StageState &state = stages[knob];
+            if (rate < lastRate * 0.95)
+            {
+                // the step hurt: take it back and try the other direction next time. The next period
+                // runs on the old limits again and only measures, so the recovery isn't credited to a new step
+                Move(state, -lastStep);
+                state.direction = lastStep > 0 ? -1 : 1;
+                knob = (knob + 1) % StageCount;
+                lastStep = 0;
+                return;
+            }
+            else if (rate <= lastRate * 1.05)
+            {
+                // no real change: leave the limit and move on to the next one
+                knob = (knob + 1) % StageCount;
+            }
+        }
+        lastRate = rate;
+
+        // step a limit that still has room in its direction, a quarter of it at a time
+        for (size_t tried = 0; tried < StageCount; tried++)
+        {
+            StageState &state = stages[knob];
+            lastStep = Move(state, std::max<ptrdiff_t>(ptrdiff_t(state.limit) / 4, 1) * state.direction);
+            if (lastStep != 0)
+                return;
+            state.direction = -state.direction;
+            knob = (knob + 1) % StageCount;
+        }
+    }
+    //moves the limit by step within the bounds, returns how far it actually moved
+    ptrdiff_t Move(StageState &state, ptrdiff_t step)
+    {
+        ptrdiff_t limit = std::max<ptrdiff_t>(ptrdiff_t(state.limit) + step, ptrdiff_t(state.bounds.min));
+        limit = std::min<ptrdiff_t>(limit, ptrdiff_t(state.bounds.max));
+        ptrdiff_t moved = limit - ptrdiff_t(state.limit);
+        state.limit = size_t(limit);
+        state.gate.SetLimit(size_t(limit));
+        return moved;
+    }
+
+    StageState stages[StageCount];
+    std::chrono::milliseconds period;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    bool measured;
+    size_t knob;
+    ptrdiff_t lastStep;
+    double lastRate;
+    std::thread controller;
+};
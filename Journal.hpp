@@ -0,0 +1,137 @@
+#pragma once
+#include "SdfArchive.hpp"
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+
+// Append-only record of the assets a run has finished, so an interrupted run resumes where it stopped.
+// One line per asset: absolute toc path, toc size and the asset's index in the toc. Lines are written in batches,
+// after the outputs they cover are flushed, and the journal itself is flushed before the batch counts.
+// A line cut off by a crash has no newline and is ignored on load.
+class Journal
+{
+public:
+    static const size_t BATCH_COUNT = 256;
+
+    Journal(const PathString &journalPath, const PathString &outputDir)
+        : outputDir(outputDir)
+        , syncsFileSystem(SyncFileSystem(outputDir))
+        , pendingCount(0)
+        , lastFlush(std::chrono::steady_clock::now())
+    {
+        std::ifstream stream(journalPath, std::ios::binary);
+        std::string line;
+        bool torn = false;
+        while (std::getline(stream, line))
+        {
+            if (stream.eof())
+            {
+                torn = !line.empty();
+                break;
+            }
+            size_t indexBegin = line.rfind('\t');
+            if (indexBegin == std::string::npos || line.find_first_not_of("0123456789", indexBegin + 1) != std::string::npos ||
+                indexBegin + 1 == line.size())
+                continue;
+            size_t index = std::stoul(line.substr(indexBegin + 1));
+            std::vector<bool> &done = loaded[line.substr(0, indexBegin)];
+            if (done.size() <= index)
+                done.resize(index + 1, false);
+            done[index] = true;
+        }
+        stream.close();
+        output.reset(new OutputFile(journalPath, true));
+        if (torn)
+            output->Write({ DataSpan{ reinterpret_cast<const unsigned char*>("\n"), 1 } });
+    }
+    ~Journal()
+    {
+        try
+        {
+            Flush();
+        }
+        catch (const std::exception &ex)
+        {
+            PrintLine(std::string("!!!Error: journal: ") + ex.what());
+        }
+    }
+    //outputs must be flushed one by one before they are recorded, the file system can't be flushed at once
+    bool SyncsFileSystem() const
+    {
+        return syncsFileSystem;
+    }
+    //takes over what earlier runs finished in this toc, call once the toc is parsed
+    void Load(const SdfArchive &archive)
+    {
+        std::string key = Key(archive);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<bool> &done = completed[&archive];
+        done = loaded[key];
+        done.resize(archive.Assets().size(), false);
+        keys[&archive] = key;
+    }
+    bool Done(const SdfArchive &archive, const SdfAsset &asset)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = completed.find(&archive);
+        return it != completed.end() && it->second[&asset - archive.Assets().data()];
+    }
+    //the asset's output is complete under its final name
+    void Complete(const SdfArchive &archive, const SdfAsset &asset)
+    {
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t index = &asset - archive.Assets().data();
+            pending += keys[&archive] + "\t" + std::to_string(index) + "\n";
+            pendingCount++;
+            if (pendingCount < BATCH_COUNT && std::chrono::steady_clock::now() - lastFlush < std::chrono::seconds(1))
+                return;
+            batch.swap(pending);
+            pendingCount = 0;
+            lastFlush = std::chrono::steady_clock::now();
+        }
+        Write(batch);
+    }
+    void Flush()
+    {
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.swap(pending);
+            pendingCount = 0;
+        }
+        Write(batch);
+    }
+private:
+    std::string Key(const SdfArchive &archive)
+    {
+        // the whole path tells apart tocs of the same name in different directories,
+        // the size a patched toc from the one the indices were taken from
+        boost::filesystem::path tocPath = boost::filesystem::absolute(archive.TocPath()).lexically_normal();
+        return tocPath.string() + "\t" + std::to_string(FileSize(archive.TocPath()));
+    }
+    void Write(const std::string &batch)
+    {
+        if (batch.empty())
+            return;
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (syncsFileSystem)
+            SyncFileSystem(outputDir);
+        output->Write({ DataSpan{ reinterpret_cast<const unsigned char*>(batch.data()), batch.size() } });
+        output->Sync();
+    }
+
+    PathString outputDir;
+    bool syncsFileSystem;
+    std::unique_ptr<OutputFile> output;
+    std::unordered_map<std::string, std::vector<bool>> loaded;
+    std::mutex mutex;
+    std::unordered_map<const SdfArchive*, std::vector<bool>> completed;
+    std::unordered_map<const SdfArchive*, std::string> keys;
+    std::string pending;
+    size_t pendingCount;
+    std::chrono::steady_clock::time_point lastFlush;
+    std::mutex writeMutex;
+};
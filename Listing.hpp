@@ -0,0 +1,207 @@
+#pragma once
+#include "SdfArchive.hpp"
+#include <map>
+
+
+// Tables of parsed tocs for the list and stats commands, written as csv or json.
+// Only the asset lists are read, packages are never opened.
+enum ListFormat
+{
+    ListFormatCsv,
+    ListFormatJson
+};
+
+inline std::string CsvField(const std::string &text)
+{
+    if (text.find_first_of(",\"\r\n") == std::string::npos)
+        return text;
+    std::string quoted = "\"";
+    for (char ch : text)
+    {
+        if (ch == '"')
+            quoted += '"';
+        quoted += ch;
+    }
+    return quoted + "\"";
+}
+
+inline std::string JsonString(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            quoted += '\\';
+            quoted += ch;
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(static_cast<unsigned char>(ch)));
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += ch;
+        }
+    }
+    return quoted + "\"";
+}
+
+inline std::string TocName(const SdfArchive &archive)
+{
+    return boost::filesystem::path(archive.TocPath()).filename().string();
+}
+
+inline std::string PackageName(const SdfArchive &archive, uint16_t packageId)
+{
+    return boost::filesystem::path(archive.PackagePath(packageId)).filename().string();
+}
+
+// one row per chunk, multi chunk assets list their chunks in file order
+inline void WriteList(std::ostream &stream, const std::vector<const SdfArchive*> &archives, ListFormat format)
+{
+    if (format == ListFormatCsv)
+        stream << "toc,path,chunk,package,packageId,offset,compressedSize,decompressedSize,pages,ddsType\n";
+    else
+        stream << "[";
+
+    bool first = true;
+    for (const SdfArchive *archive : archives)
+    {
+        std::string toc = TocName(*archive);
+        for (const SdfAsset &asset : archive->Assets())
+        {
+            for (size_t chunkIndex = 0; chunkIndex < asset.chunks.size(); chunkIndex++)
+            {
+                const SdfChunk &chunk = asset.chunks[chunkIndex];
+                std::string package = PackageName(*archive, chunk.packageId);
+                size_t pages = chunk.hasCompression ? chunk.compSizeArray.size() : 0;
+                if (format == ListFormatCsv)
+                {
+                    stream << CsvField(toc) << "," << CsvField(asset.name) << "," << chunkIndex << "," << CsvField(package) << ","
+                        << chunk.packageId << "," << chunk.packageOffset << "," << chunk.StoredSize() << "," << chunk.decompressedSize << ","
+                        << pages << ",";
+                    if (asset.hasDdsHeader)
+                        stream << asset.ddsType;
+                    stream << "\n";
+                }
+                else
+                {
+                    stream << (first ? "\n" : ",\n") << "{\"toc\":" << JsonString(toc) << ",\"path\":" << JsonString(asset.name)
+                        << ",\"chunk\":" << chunkIndex << ",\"package\":" << JsonString(package) << ",\"packageId\":" << chunk.packageId
+                        << ",\"offset\":" << chunk.packageOffset << ",\"compressedSize\":" << chunk.StoredSize()
+                        << ",\"decompressedSize\":" << chunk.decompressedSize << ",\"pages\":" << pages << ",\"ddsType\":";
+                    if (asset.hasDdsHeader)
+                        stream << asset.ddsType;
+                    else
+                        stream << "null";
+                    stream << "}";
+                }
+                first = false;
+            }
+        }
+    }
+    if (format == ListFormatJson)
+        stream << "\n]\n";
+}
+
+struct ListTotals
+{
+    ListTotals()
+        : assets(0)
+        , chunks(0)
+        , storedBytes(0)
+        , decompressedBytes(0)
+    {
+    }
+    uint64_t assets;
+    uint64_t chunks;
+    uint64_t storedBytes;
+    uint64_t decompressedBytes;
+};
+
+// totals over everything, per package and per file extension. An asset counts once
+// for every package one of its chunks lives in, sizes are always per chunk
+inline void WriteStats(std::ostream &stream, const std::vector<const SdfArchive*> &archives, ListFormat format)
+{
+    ListTotals total;
+    std::map<std::string, ListTotals> packages;
+    std::map<std::string, ListTotals> extensions;
+    for (const SdfArchive *archive : archives)
+    {
+        for (const SdfAsset &asset : archive->Assets())
+        {
+            size_t dot = asset.name.rfind('.');
+            size_t slash = asset.name.rfind('/');
+            std::string extension = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? "" : asset.name.substr(dot);
+            std::transform(extension.begin(), extension.end(), extension.begin(), [](char ch) { return char(tolower(static_cast<unsigned char>(ch))); });
+
+            ListTotals &extensionTotals = extensions[extension];
+            total.assets++;
+            extensionTotals.assets++;
+            std::vector<std::string> assetPackages;
+            for (const SdfChunk &chunk : asset.chunks)
+            {
+                std::string package = PackageName(*archive, chunk.packageId);
+                ListTotals &packageTotals = packages[package];
+                if (std::find(assetPackages.begin(), assetPackages.end(), package) == assetPackages.end())
+                {
+                    assetPackages.push_back(package);
+                    packageTotals.assets++;
+                }
+                for (ListTotals *totals : { &total, &packageTotals, &extensionTotals })
+                {
+                    totals->chunks++;
+                    totals->storedBytes += chunk.StoredSize();
+                    totals->decompressedBytes += chunk.decompressedSize;
+                }
+            }
+        }
+    }
+
+    auto ratio = [](const ListTotals &totals)
+    {
+        return totals.decompressedBytes ? double(totals.storedBytes) / double(totals.decompressedBytes) : 1.0;
+    };
+    if (format == ListFormatCsv)
+    {
+        auto row = [&](const char *table, const std::string &key, const ListTotals &totals)
+        {
+            stream << table << "," << CsvField(key) << "," << totals.assets << "," << totals.chunks << "," << totals.storedBytes << ","
+                << totals.decompressedBytes << "," << ratio(totals) << "\n";
+        };
+        stream << "table,key,assets,chunks,compressedSize,decompressedSize,ratio\n";
+        row("total", "", total);
+        for (const auto &package : packages)
+            row("package", package.first, package.second);
+        for (const auto &extension : extensions)
+            row("extension", extension.first, extension.second);
+    }
+    else
+    {
+        auto object = [&](const ListTotals &totals)
+        {
+            stream << "\"assets\":" << totals.assets << ",\"chunks\":" << totals.chunks << ",\"compressedSize\":" << totals.storedBytes
+                << ",\"decompressedSize\":" << totals.decompressedBytes << ",\"ratio\":" << ratio(totals) << "}";
+        };
+        auto table = [&](const char *name, const char *keyName, const std::map<std::string, ListTotals> &rows)
+        {
+            stream << ",\n\"" << name << "\":[";
+            bool first = true;
+            for (const auto &row : rows)
+            {
+                stream << (first ? "\n" : ",\n") << "{\"" << keyName << "\":" << JsonString(row.first) << ",";
+                object(row.second);
+                first = false;
+            }
+            stream << "\n]";
+        };
+        stream << "{\n\"total\":{\"tocs\":" << archives.size() << ",";
+        object(total);
+        table("packages", "package", packages);
+        table("extensions", "extension", extensions);
+        stream << "\n}\n";
+    }
+}
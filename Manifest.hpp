@@ -0,0 +1,92 @@
+#pragma once
+#include "utils.h"
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+
+struct ManifestEntry
+{
+    std::string toc;
+    std::string name;
+    uint64_t bytes;
+};
+
+// Files one shard extracted, a tab separated text file with one asset per line.
+// The header names the shard, so merging can tell whether every shard is there.
+class Manifest
+{
+public:
+    Manifest(size_t shard, size_t shardCount)
+        : shard(shard)
+        , shardCount(shardCount)
+    {
+    }
+    void Add(const Manifest &other)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+    }
+    void Add(ManifestEntry entry)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.push_back(std::move(entry));
+    }
+    //entries sorted by name, workers finish in any order
+    void Write(const PathString &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::sort(entries.begin(), entries.end(), [](const ManifestEntry &a, const ManifestEntry &b)
+        {
+            return a.name != b.name ? a.name < b.name : a.toc < b.toc;
+        });
+        std::ofstream stream(path, std::ios::binary);
+        stream << "# rouge_sdf manifest " << shard << "/" << shardCount << "\n";
+        for (const ManifestEntry &entry : entries)
+        {
+            stream << entry.toc << "\t" << entry.name << "\t" << entry.bytes << "\n";
+        }
+        if (!stream.good())
+            throw std::runtime_error("Failed to write manifest");
+    }
+    //reads a manifest written by Write
+    explicit Manifest(const PathString &path)
+        : shard(0)
+        , shardCount(0)
+    {
+        std::ifstream stream(path, std::ios::binary);
+        std::string line;
+        unsigned long long header[2] = {};
+        if (!std::getline(stream, line) || sscanf(line.c_str(), "# rouge_sdf manifest %llu/%llu", &header[0], &header[1]) != 2)
+            throw std::runtime_error("Not a manifest");
+        shard = size_t(header[0]);
+        shardCount = size_t(header[1]);
+
+        while (std::getline(stream, line))
+        {
+            size_t nameBegin = line.find('\t');
+            size_t bytesBegin = line.rfind('\t');
+            if (nameBegin == std::string::npos || bytesBegin == nameBegin)
+                throw std::runtime_error("Broken manifest line");
+            entries.push_back(ManifestEntry{ line.substr(0, nameBegin),
+                line.substr(nameBegin + 1, bytesBegin - nameBegin - 1), std::stoull(line.substr(bytesBegin + 1)) });
+        }
+    }
+    size_t Shard() const
+    {
+        return shard;
+    }
+    size_t ShardCount() const
+    {
+        return shardCount;
+    }
+    const std::vector<ManifestEntry> &Entries() const
+    {
+        return entries;
+    }
+private:
+    size_t shard;
+    size_t shardCount;
+    std::mutex mutex;
+    std::vector<ManifestEntry> entries;
+};
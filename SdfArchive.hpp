@@ -0,0 +1,280 @@
+#pragma once
+#include "BasicFile.hpp"
+#include "utils.h"
+#include <boost/filesystem.hpp>
+#include <future>
+
+#pragma pack(push,1)
+struct SdfTocHeader
+{
+    uint32_t fileTag; //0x54534557
+    uint32_t fileVersion;
+    uint32_t decompressedSize;
+    uint32_t compressedSize;
+    uint32_t zero;
+    uint32_t block1count;
+    uint32_t ddsHeaderBlockCount;
+};
+struct SdfTocId
+{
+    uint64_t massive;
+    uint8_t data[0x20];
+    uint64_t ubisoft;
+};
+
+struct SdfDdsHeader
+{
+    uint32_t usedBytes;
+    uint8_t bytes[200];
+};
+
+#pragma pack(pop)
+
+static const size_t CHUNK_SIZE = 0x10000;
+
+struct SdfChunk
+{
+    uint16_t packageId;
+    uint64_t packageOffset;
+    bool hasCompression;
+    uint64_t decompressedSize;
+    uint64_t compressedSize;
+    // compressed size of every CHUNK_SIZE page, 0 marks a page stored raw
+    std::vector<uint64_t> compSizeArray;
+
+    // bytes the chunk occupies in its package
+    uint64_t StoredSize() const
+    {
+        if (!hasCompression)
+            return decompressedSize;
+        if (compSizeArray.size() == 1)
+            return compSizeArray[0];
+
+        uint64_t storedSize = 0;
+        uint64_t MySize = decompressedSize;
+        for (uint64_t compSizePart : compSizeArray)
+        {
+            uint64_t chunkSize = std::min<uint64_t>(MySize, CHUNK_SIZE);
+            storedSize += (compSizePart == 0 || compSizePart >= chunkSize) ? chunkSize : compSizePart;
+            MySize -= chunkSize;
+        }
+        return storedSize;
+    }
+};
+
+struct SdfAsset
+{
+    std::string name;
+    uint64_t ddsType;
+    bool hasDdsHeader;
+    std::vector<SdfChunk> chunks;
+
+    // payload bytes of the extracted file, without the dds header
+    uint64_t DecompressedSize() const
+    {
+        uint64_t size = 0;
+        for (const SdfChunk &chunk : chunks)
+            size += chunk.decompressedSize;
+        return size;
+    }
+};
+
+uint64_t readVariadicInteger(File& data, uint32_t count)
+{
+	uint64_t result = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		result |= uint64_t(data.Read<uint8_t>()) << (i * 8);
+	}
+	return result;
+};
+
+// One .sdftoc: header, dds headers and the asset list parsed from its name tree.
+// Packages are never opened here.
+class SdfArchive
+{
+public:
+    SdfArchive(const PathString &tocPath)
+        : tocPath(tocPath)
+        , tree(nullptr)
+    {
+        auto file = MakeFileMapped(tocPath);
+
+        SdfTocHeader header = file.Read<SdfTocHeader>();
+        SdfTocId id = file.Read<SdfTocId>();
+        uint8_t signExistFlag = file.Read<uint8_t>();
+        if (signExistFlag)
+        {
+            file.Seek(0x140, FileOriginCurrent);
+        }
+
+        auto block1 = file.Array<uint32_t>(header.block1count);
+        auto SdfTocIdBlock = file.Array<SdfTocId>(header.block1count);
+        ddsHeaderBlock = file.Array<SdfDdsHeader>(header.ddsHeaderBlockCount);
+
+        // find the compressed bulk data
+        if (file.Size() < 0x30 + size_t(header.compressedSize))
+        {
+            throw std::runtime_error("Compressed file tree is out of file");
+        }
+        size_t CompressDataOffset = file.Size() - 0x30 - header.compressedSize;
+        // decompress the tree straight from the mapped view, parsing starts on the first decompressed bytes
+        tree = MakeBlockZstdStream(file.Part(CompressDataOffset, header.compressedSize), header.decompressedSize);
+    }
+    //search branches are walked on their own threads down to forkDepth search nodes,
+    //the asset order is the same as a walk on one thread
+    void Parse(unsigned forkDepth = 0)
+    {
+        File memoryFile(tree);
+        ParseNames(memoryFile, "", assets, forkDepth);
+        // everything needed later lives in the asset list now
+        tree = nullptr;
+    }
+    const PathString &TocPath() const
+    {
+        return tocPath;
+    }
+    PathString PackagePath(uint16_t packageId) const
+    {
+        boost::filesystem::path sdfTocPath(tocPath);
+        char dataFormated[32];
+        snprintf(dataFormated, sizeof(dataFormated), "-%c-%04i.sdfdata", char('A' + packageId / 1000), int(packageId));
+        return (sdfTocPath.parent_path() / sdfTocPath.stem()).native() + NativePath(dataFormated);
+    }
+    size_t DdsHeaderCount() const
+    {
+        return ddsHeaderBlock.Size();
+    }
+    SdfDdsHeader DdsHeader(uint64_t ddsType) const
+    {
+        return ddsHeaderBlock[ddsType];
+    }
+    const std::vector<SdfAsset> &Assets() const
+    {
+        return assets;
+    }
+private:
+    void ParseNames(File& memoryFile, std::string name, std::vector<SdfAsset> &found, unsigned forkDepth)
+    {
+        auto ch = memoryFile.Read<char>();
+        if (ch == 0)
+        {
+            // only this branch is lost, stdout may hold a list or stats table
+            PrintError("Error: Unexcepted byte in file tree!");
+            return;
+        }
+        else if (ch >= 1 && ch <= 0x1f) //string part
+        {
+            while (ch--)
+            {
+                name += memoryFile.Read<char>();
+            }
+            ParseNames(memoryFile, name, found, forkDepth);
+        }
+        else if (ch >= 'A' && ch <= 'Z') //file entry
+        {
+            ch = ch - 'A';
+            char count1 = ch & 7;
+            if (count1 != 0)
+            {
+                SdfAsset asset;
+                asset.name = name;
+                uint32_t strangeId = memoryFile.Read<uint32_t>();
+                uint8_t ch2 = memoryFile.Read<uint8_t>();
+                ch2 &= 3;
+                asset.ddsType = readVariadicInteger(memoryFile, ch2);
+                asset.hasDdsHeader = ch2 != 0;
+
+                for (int chunkIndex = 0; chunkIndex < count1; chunkIndex++)
+                {
+                    auto ch3 = memoryFile.Read<uint8_t>();
+                    if (ch3 == 0)
+                    {
+                        break;
+                    }
+
+                    SdfChunk chunk;
+                    auto compressedSizeByteCount = (ch3 & 3) + 1;
+                    auto packageOffsetByteCount = (ch3 >> 2) & 7;
+                    chunk.hasCompression = (ch3 >> 5) & 1;
+
+                    chunk.decompressedSize = readVariadicInteger(memoryFile, compressedSizeByteCount);
+					//putvarchr decompressedSize 8 0
+					//getvarchr decompressedSize decompressedSize 0 long
+                    chunk.decompressedSize &= 0x00000000FFFFFFFFull;
+                    chunk.compressedSize = 0;
+                    if (chunk.hasCompression)
+                    {
+                        chunk.compressedSize = readVariadicInteger(memoryFile, compressedSizeByteCount);
+						//putvarchr compressedSize 8 0
+						//getvarchr compressedSize compressedSize 0 long
+                        chunk.compressedSize &= 0x00000000FFFFFFFFull;
+                    }
+
+                    chunk.packageOffset = readVariadicInteger(memoryFile, packageOffsetByteCount);
+					//putvarchr packageOffset 8 0
+					//getvarchr packageOffset packageOffset 0 longlong
+                    chunk.packageOffset &= 0x00FFFFFFFFFFFFFFull;
+					chunk.packageId = memoryFile.Read<uint16_t>();
+
+                    if (chunk.hasCompression)
+                    {
+                        size_t pageCount = (chunk.decompressedSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+                        if (pageCount > 1)
+                        {
+                            for (size_t page = 0; page < pageCount; page++)
+                            {
+                                uint16_t compSize = memoryFile.Read<uint16_t>();
+                                chunk.compSizeArray.push_back(compSize);
+                            }
+                        }
+                        else if (pageCount == 1)
+                        {
+                            chunk.compSizeArray.push_back(chunk.compressedSize);
+                        }
+                    }
+                    asset.chunks.push_back(std::move(chunk));
+                }
+				uint32_t fileId = memoryFile.Read<uint32_t>();
+                found.push_back(std::move(asset));
+            }
+
+            if (ch & 8) //if (flag1)
+            {
+                auto ch3 = memoryFile.Read<uint8_t>();
+                readVariadicInteger(memoryFile, ch3);
+            }
+        }
+        else //search tree entry
+        {
+            uint32_t offset = memoryFile.Read<uint32_t>();
+            if (forkDepth == 0)
+            {
+                ParseNames(memoryFile, name, found, 0);
+
+                memoryFile.Seek(offset);
+                ParseNames(memoryFile, name, found, 0);
+                return;
+            }
+
+            // nothing after a branch depends on where the other one stopped: the second one
+            // gets its own cursor and list and is appended once the first one is done
+            std::vector<SdfAsset> branchAssets;
+            auto branch = std::async(std::launch::async, [this, offset, name, &branchAssets, forkDepth]
+            {
+                File branchFile(tree);
+                branchFile.Seek(offset);
+                ParseNames(branchFile, name, branchAssets, forkDepth - 1);
+            });
+            ParseNames(memoryFile, name, found, forkDepth - 1);
+            branch.get();
+            found.insert(found.end(), std::make_move_iterator(branchAssets.begin()), std::make_move_iterator(branchAssets.end()));
+        }
+    }
+
+    PathString tocPath;
+    DataArray<SdfDdsHeader> ddsHeaderBlock;
+    BlockPtr tree;
+    std::vector<SdfAsset> assets;
+};
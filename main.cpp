@@ -1,376 +1,592 @@
 #include "BasicFile.hpp"
+#include "SdfArchive.hpp"
+#include "Extractor.hpp"
+#include "ExtractionPlan.hpp"
+#include "Manifest.hpp"
+#include "Listing.hpp"
 #include "utils.h"
-#include <zstd.h>
-#include <boost\filesystem.hpp>
-#include <boost\format.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
 
-#pragma pack(push,1)
-struct SdfTocHeader
+struct Options
 {
-    uint32_t fileTag; //0x54534557
-    uint32_t fileVersion;
-    uint32_t decompressedSize;
-    uint32_t compressedSize;
-    uint32_t zero;
-    uint32_t block1count;
-    uint32_t ddsHeaderBlockCount;
+    Options()
+        : threadCount(std::max(std::thread::hardware_concurrency(), 1u))
+        , diskOrder(false)
+        , readaheadBytes(32 << 20)
+        , coalesceGap(64 << 10)
+        , coalesceSpan(4 << 20)
+        , autotune(false)
+        , tuneLimits(false)
+        , tuneBounds()
+        , shard(0)
+        , shardCount(1)
+        , maxMemory(0)
+        , resume(false)
+    {
+    }
+    size_t threadCount;
+    bool diskOrder;
+    uint64_t readaheadBytes;
+    uint64_t coalesceGap;
+    uint64_t coalesceSpan;
+    bool autotune;
+    // bounds were given, without --autotune every limit stays at its max
+    bool tuneLimits;
+    // 0:0 until given, filled in from the thread count
+    IoTuner::Bounds tuneBounds[IoTuner::StageCount];
+    // 0 based here, 1 based on the command line
+    size_t shard;
+    size_t shardCount;
+    // 0 for no limit
+    uint64_t maxMemory;
+    bool resume;
+    PathString outputDir;
+    std::vector<PathString> tocFiles;
 };
-struct SdfTocId
+
+void PrintUsage()
 {
-    uint64_t massive;
-    uint8_t data[0x20];
-    uint64_t ubisoft;
-};
+    std::cout << "Mario + Rabbids Kingdom Battle .sdftoc extractor" << std::endl;
+    std::cout << "usage: rouge_sdf.exe [options] <.sdftoc path> <output directory>" << std::endl;
+    std::cout << "       rouge_sdf.exe batch [options] <output directory> <.sdftoc path|directory|@list file>..." << std::endl;
+    std::cout << "       rouge_sdf.exe merge <merged manifest> <shard manifest>..." << std::endl;
+    std::cout << "       rouge_sdf.exe list|stats [--format csv|json] [--threads <count>] <.sdftoc path|directory|@list file>..." << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << "  --threads <count>   worker threads shared by all .sdftoc files" << std::endl;
+    std::cout << "  --order tree|disk   extract in name tree order (default) or sorted by package offset" << std::endl;
+    std::cout << "  --readahead <MiB>   readahead window for --order disk, 0 disables hints (default 32)" << std::endl;
+    std::cout << "  --coalesce-gap <KiB>  --order disk merges reads of entries at most this far apart (default 64)" << std::endl;
+    std::cout << "  --coalesce-span <KiB> largest merged read, 0 disables merging (default 4096)" << std::endl;
+    std::cout << "  --autotune          adjust reads, workers and writes in flight to the measured throughput" << std::endl;
+    std::cout << "  --tune-reads <min:max>, --tune-workers <min:max>, --tune-writes <min:max>" << std::endl;
+    std::cout << "                      bounds for --autotune (default 1:threads), alone they fix each limit at max" << std::endl;
+    std::cout << "  --max-memory <MiB>  keep buffers in flight and kept for reuse under this limit, parsed tocs not counted; huge assets are written page by page" << std::endl;
+    std::cout << "  --resume            record finished assets in rouge_sdf.journal in the output directory" << std::endl;
+    std::cout << "                      and skip the ones it lists, files it doesn't list are extracted again" << std::endl;
+    std::cout << "  --shard <K/N>       extract only shard K of N (1 based), balanced by decompressed bytes," << std::endl;
+    std::cout << "                      and write the files extracted to shard-K-of-N.manifest in the output directory" << std::endl;
+}
 
-struct SdfDdsHeader
+// .sdftoc files, directories holding them and text files listing one path per line
+void AddTocInput(Options &options, const PathString &input)
 {
-    uint32_t usedBytes;
-    uint8_t bytes[200];
-};
+    if (!input.empty() && input[0] == PATH_TEXT('@'))
+    {
+        std::ifstream list(input.substr(1));
+        if (!list.good())
+            throw std::runtime_error("Cannot open list file");
+        std::string line;
+        while (std::getline(list, line))
+        {
+            line.erase(line.find_last_not_of(" \t\r\n") + 1);
+            if (!line.empty())
+                AddTocInput(options, NativePath(line));
+        }
+    }
+    else if (boost::filesystem::is_directory(input))
+    {
+        PathString directory = boost::filesystem::path(input).remove_trailing_separator().native() + PATH_SEPARATOR;
+        std::vector<PathString> tocFiles = EnumerateDirectory(directory, PATH_TEXT("*.sdftoc"));
+        std::sort(tocFiles.begin(), tocFiles.end());
+        options.tocFiles.insert(options.tocFiles.end(), tocFiles.begin(), tocFiles.end());
+    }
+    else
+    {
+        options.tocFiles.push_back(input);
+    }
+}
+
+// "min:max" or a single value for both
+IoTuner::Bounds ParseBounds(const PathString &text)
+{
+    size_t separator = text.find(PATH_TEXT(':'));
+    IoTuner::Bounds bounds;
+    bounds.min = std::stoul(text.substr(0, separator));
+    bounds.max = separator == PathString::npos ? bounds.min : std::stoul(text.substr(separator + 1));
+    if (bounds.min == 0 || bounds.max < bounds.min)
+        throw std::runtime_error("Bad bounds");
+    return bounds;
+}
+
+bool ParseOptions(int argc, PathChar* argv[], Options &options)
+{
+    bool batch = argc > 1 && PathString(argv[1]) == PATH_TEXT("batch");
+    std::vector<PathString> positional;
+    for (int i = batch ? 2 : 1; i < argc; i++)
+    {
+        PathString arg = argv[i];
+        if (arg == PATH_TEXT("--threads") && i + 1 < argc)
+        {
+            options.threadCount = std::max(std::stoul(argv[++i]), 1ul);
+        }
+        else if (arg == PATH_TEXT("--order") && i + 1 < argc)
+        {
+            PathString order = argv[++i];
+            if (order != PATH_TEXT("tree") && order != PATH_TEXT("disk"))
+                return false;
+            options.diskOrder = order == PATH_TEXT("disk");
+        }
+        else if (arg == PATH_TEXT("--readahead") && i + 1 < argc)
+        {
+            options.readaheadBytes = uint64_t(std::stoull(argv[++i])) << 20;
+        }
+        else if (arg == PATH_TEXT("--coalesce-gap") && i + 1 < argc)
+        {
+            options.coalesceGap = uint64_t(std::stoull(argv[++i])) << 10;
+        }
+        else if (arg == PATH_TEXT("--coalesce-span") && i + 1 < argc)
+        {
+            options.coalesceSpan = uint64_t(std::stoull(argv[++i])) << 10;
+        }
+        else if (arg == PATH_TEXT("--autotune"))
+        {
+            options.autotune = true;
+        }
+        else if (arg == PATH_TEXT("--tune-reads") && i + 1 < argc)
+        {
+            options.tuneBounds[IoTuner::Reads] = ParseBounds(argv[++i]);
+            options.tuneLimits = true;
+        }
+        else if (arg == PATH_TEXT("--tune-workers") && i + 1 < argc)
+        {
+            options.tuneBounds[IoTuner::Workers] = ParseBounds(argv[++i]);
+            options.tuneLimits = true;
+        }
+        else if (arg == PATH_TEXT("--tune-writes") && i + 1 < argc)
+        {
+            options.tuneBounds[IoTuner::Writes] = ParseBounds(argv[++i]);
+            options.tuneLimits = true;
+        }
+        else if (arg == PATH_TEXT("--max-memory") && i + 1 < argc)
+        {
+            options.maxMemory = uint64_t(std::stoull(argv[++i])) << 20;
+        }
+        else if (arg == PATH_TEXT("--resume"))
+        {
+            options.resume = true;
+        }
+        else if (arg == PATH_TEXT("--shard") && i + 1 < argc)
+        {
+            PathString shard = argv[++i];
+            size_t separator = shard.find(PATH_TEXT('/'));
+            if (separator == PathString::npos)
+                return false;
+            options.shard = std::stoul(shard.substr(0, separator));
+            options.shardCount = std::stoul(shard.substr(separator + 1));
+            if (options.shard == 0 || options.shard > options.shardCount)
+                return false;
+            options.shard--;
+        }
+        else if (arg.compare(0, 2, PATH_TEXT("--")) == 0)
+        {
+            PrintLine(PATH_TEXT("Unknown option: ") + arg);
+            return false;
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+
+    if (batch)
+    {
+        if (positional.size() < 2)
+            return false;
+        options.outputDir = positional[0];
+        for (size_t i = 1; i < positional.size(); i++)
+        {
+            AddTocInput(options, positional[i]);
+        }
+    }
+    else
+    {
+        if (positional.size() != 2)
+            return false;
+        options.tocFiles.push_back(positional[0]);
+        options.outputDir = positional[1];
+    }
+    options.outputDir = boost::filesystem::path(options.outputDir).remove_trailing_separator().native() + PATH_SEPARATOR;
 
-#pragma pack(pop)
+    // the pool needs a thread for every worker the tuner may allow
+    if (options.tuneBounds[IoTuner::Workers].max)
+        options.threadCount = options.tuneBounds[IoTuner::Workers].max;
+    for (IoTuner::Bounds &bounds : options.tuneBounds)
+    {
+        if (!bounds.max)
+            bounds = IoTuner::Bounds{ 1, options.threadCount };
+    }
+    return true;
+}
 
-static const size_t CHUNK_SIZE = 0x10000;
-void DumpFile(File& data, const std::string& name, 
-	uint16_t packageId, uint64_t packageOffset,
-	bool hasCompression, uint64_t decompressedSize, uint64_t compressedSize,
-	uint64_t ddsType, bool append, bool useDDS);
+// Name tree branches parsed in parallel, each on a thread of its own outside the pool.
+// The tocs already parse side by side, so only the threads left over per toc are forked.
+unsigned ForkDepth(size_t threadCount, size_t tocCount)
+{
+    size_t threadsPerToc = threadCount / std::max<size_t>(tocCount, 1);
+    unsigned forkDepth = 0;
+    while ((size_t(1) << forkDepth) < threadsPerToc)
+        forkDepth++;
+    return forkDepth;
+}
 
-uint64_t readVariadicInteger(File& data, uint32_t count)
+void LoadArchive(SdfArchive &archive, unsigned forkDepth)
 {
-	uint64_t result = 0;
+    // display all dds header info:
+    std::stringstream ss;
+    ss << "\nFound dds header infos:\n";
+    for (size_t ddsIdx = 0; ddsIdx < archive.DdsHeaderCount(); ++ddsIdx)
+    {
+        const SdfDdsHeader DDSHeader = archive.DdsHeader(ddsIdx);
+        ss << "[" << ddsIdx << "] Header Size = " << DDSHeader.usedBytes << "\n";
+    }
+    PrintLine(PATH_TEXT("Parse: ") + archive.TocPath());
+    PrintLine(ss.str());
 
-	for (uint32_t i = 0; i < count; i++)
-	{
-		result |= uint64_t(data.Read<uint8_t>()) << (i * 8);
-	}
-	return result;
-};
+    archive.Parse(forkDepth);
+}
 
-struct FileTree
+// Every .sdftoc is parsed in its own task and its assets go to the same pool,
+// so small tocs don't leave threads idle while a big one is still extracting.
+// In disk order all tocs are parsed first and the assets are queued sorted by
+// package offset, with readahead hints running ahead of the workers.
+// With --shard only this node's share of the assets is queued, and the files
+// extracted are listed in a manifest.
+void RunExtraction(const Options &options)
 {
-    static void ParseNames(File& memoryFile, std::string name="")
+    auto startTime = std::chrono::steady_clock::now();
+    // assets are queued only once every toc is parsed when they have to be sorted or split
+    bool collect = options.diskOrder || options.shardCount > 1;
+    std::vector<std::unique_ptr<SdfArchive>> archives(options.tocFiles.size());
+    PackageCache packages;
+    std::unique_ptr<IoTuner> tuner;
+    if (options.autotune || options.tuneLimits)
+        tuner.reset(new IoTuner(options.tuneBounds, options.autotune));
+    // half of the limit for buffers in flight, half for the free buffers the pool keeps for reuse:
+    // handing those back to the heap instead leaves them in the allocator's per thread arenas
+    std::unique_ptr<MemoryBudget> memory;
+    if (options.maxMemory)
     {
-        auto ch = memoryFile.Read<char>();
-        if (ch == 0)
+        memory.reset(new MemoryBudget(options.maxMemory / 2));
+        BufferPool::Instance().SetRetainLimit(size_t(options.maxMemory / 2));
+    }
+    // a merged read is reserved whole, it has to fit next to the assets sliced out of it
+    uint64_t coalesceSpan = memory ? std::min(options.coalesceSpan, memory->Limit() / 4) : options.coalesceSpan;
+    std::unique_ptr<Journal> journal;
+    if (options.resume)
+    {
+        CreateDirectoryRecursively(options.outputDir);
+        journal.reset(new Journal(options.outputDir + PATH_TEXT("rouge_sdf.journal"), options.outputDir));
+    }
+    Extractor extractor(packages, options.outputDir, tuner.get(), memory.get(), journal.get());
+    WorkerPool pool(options.threadCount);
+    unsigned forkDepth = ForkDepth(options.threadCount, options.tocFiles.size());
+
+    // tocs parse in any order, but their assets are claimed and queued toc by toc in the order given,
+    // so of the assets writing the same file the first of the first toc wins on every run
+    std::mutex releaseMutex;
+    std::vector<bool> parsed(options.tocFiles.size(), false);
+    size_t released = 0;
+    std::vector<WorkItem> items;
+    auto release = [&](size_t parsedIndex)
+    {
+        std::lock_guard<std::mutex> lock(releaseMutex);
+        parsed[parsedIndex] = true;
+        for (; released < parsed.size() && parsed[released]; released++)
         {
-            std::cout << "Error: Unexcepted byte in file tree!\n";
-            return;
+            const SdfArchive *archive = archives[released].get();
+            if (!archive)
+                continue;
+            for (const SdfAsset &asset : archive->Assets())
+            {
+                if (!extractor.Claim(asset))
+                    continue;
+                if (collect)
+                {
+                    items.push_back(WorkItem{ released, archive, &asset });
+                    continue;
+                }
+                pool.Submit([&extractor, &tuner, archive, &asset]
+                {
+                    IoTuner::Slot worker(tuner.get(), IoTuner::Workers);
+                    extractor.Extract(*archive, asset);
+                });
+            }
         }
-        else if (ch >= 1 && ch <= 0x1f) //string part
+    };
+
+    for (size_t i = 0; i < options.tocFiles.size(); i++)
+    {
+        pool.Submit([&, i]
         {
-            while (ch--)
+            try
+            {
+                archives[i].reset(new SdfArchive(options.tocFiles[i]));
+                LoadArchive(*archives[i], forkDepth);
+                if (journal)
+                    journal->Load(*archives[i]);
+            }
+            catch (const std::exception & ex)
             {
-                name += memoryFile.Read<char>();
+                PrintLine(PATH_TEXT("Error: ") + options.tocFiles[i]);
+                PrintLine(std::string("Error: ") + ex.what());
+                archives[i].reset();
             }
-            ParseNames(memoryFile, name);
+            release(i);
+        });
+    }
+    pool.Wait();
+
+    if (collect)
+    {
+        std::unique_ptr<Manifest> manifest;
+        if (options.shardCount > 1)
+        {
+            items = SelectShard(items, options.shard, options.shardCount);
+            manifest.reset(new Manifest(options.shard + 1, options.shardCount));
+            uint64_t shardBytes = 0;
+            for (const WorkItem &item : items)
+                shardBytes += item.asset->DecompressedSize();
+            std::stringstream ss;
+            ss << "Shard " << options.shard + 1 << "/" << options.shardCount << ": " << items.size() << " assets, " << (shardBytes >> 20) << " MiB";
+            PrintLine(ss.str());
         }
-        else if (ch >= 'A' && ch <= 'Z') //file entry
+        auto extract = [&](const WorkItem &item, const BlockPtr &window, uint64_t windowOffset)
         {
-            ch = ch - 'A';
-            char count1 = ch & 7;
-            if (count1 != 0)
-            {
-                uint32_t strangeId = memoryFile.Read<uint32_t>();
-                uint8_t ch2 = memoryFile.Read<uint8_t>();
-                ch2 &= 3;
-                uint64_t ddsType = readVariadicInteger(memoryFile, ch2);
+            if (!extractor.Extract(*item.archive, *item.asset, window, windowOffset) || !manifest)
+                return;
+            uint64_t bytes = item.asset->DecompressedSize();
+            if (item.asset->hasDdsHeader)
+                bytes += item.archive->DdsHeader(item.asset->ddsType).usedBytes;
+            manifest->Add(ManifestEntry{ boost::filesystem::path(item.archive->TocPath()).filename().string(), item.asset->name, bytes });
+        };
+
+        if (options.diskOrder)
+        {
+            SortByDiskOrder(items);
 
-                for (int chunkIndex = 0; chunkIndex < count1; chunkIndex++)
+            Readahead readahead(packages, items, options.readaheadBytes);
+            std::vector<ReadGroup> groups = CoalesceReads(items, options.coalesceGap, coalesceSpan);
+            for (const ReadGroup &group : groups)
+            {
+                pool.Submit([&, group]
                 {
-                    auto ch3 = memoryFile.Read<uint8_t>();
-                    if (ch3 == 0)
+                    IoTuner::Slot worker(tuner.get(), IoTuner::Workers);
+                    readahead.Started(group.first + group.count - 1);
+                    BlockPtr window = nullptr;
+                    std::unique_ptr<MemoryBudget::Reservation> reservation;
+                    if (group.count > 1)
                     {
-                        break;
+                        // one read for the whole group, every asset is sliced out of it
+                        try
+                        {
+                            BlockPtr fileBlock = packages.Open(items[group.first].archive->PackagePath(group.packageId));
+                            if (fileBlock && group.end <= fileBlock->Size())
+                            {
+                                // the assets go one after another, the largest of them is all that is added to the window
+                                uint64_t planned = 0;
+                                for (size_t i = group.first; i < group.first + group.count; i++)
+                                    planned = std::max(planned, extractor.PlannedBytes(*items[i].asset));
+                                reservation.reset(new MemoryBudget::Reservation(memory.get(), BufferPool::AllocatedSize(group.end - group.begin) + planned));
+                                IoTuner::Slot read(tuner.get(), IoTuner::Reads, group.end - group.begin);
+                                window = MakeBlockMemory(fileBlock->ReadBuffer(group.begin, group.end - group.begin), group.end - group.begin);
+                            }
+                        }
+                        catch (const std::exception &ex)
+                        {
+                            // every asset of the group reads its own chunks instead
+                            PrintLine(std::string("!!!Error: merged read failed: ") + ex.what());
+                            window = nullptr;
+                            reservation.reset();
+                        }
                     }
-
-                    auto compressedSizeByteCount = (ch3 & 3) + 1;
-                    auto packageOffsetByteCount = (ch3 >> 2) & 7;
-                    auto hasCompression = (ch3 >> 5) & 1;
-
-                    uint64_t decompressedSize = readVariadicInteger(memoryFile, compressedSizeByteCount);
-					//putvarchr decompressedSize 8 0
-					//getvarchr decompressedSize decompressedSize 0 long
-                    decompressedSize &= 0x00000000FFFFFFFFull;
-                    uint64_t compressedSize = 0;
-                    if (hasCompression)
-                    {
-                        compressedSize = readVariadicInteger(memoryFile, compressedSizeByteCount);
-						//putvarchr compressedSize 8 0
-						//getvarchr compressedSize compressedSize 0 long
-                        compressedSize &= 0x00000000FFFFFFFFull;
-                    }
-
-                    uint64_t packageOffset = 0;
+                    for (size_t i = group.first; i < group.first + group.count; i++)
                     {
-                        packageOffset = readVariadicInteger(memoryFile, packageOffsetByteCount);
-						//putvarchr packageOffset 8 0
-						//getvarchr packageOffset packageOffset 0 longlong
-                        packageOffset &= 0x00FFFFFFFFFFFFFFull;
+                        extract(items[i], window, group.begin);
                     }
-					uint16_t packageId = memoryFile.Read<uint16_t>();
-					bool useDDS = (ch2 != 0 && chunkIndex == 0);
-                    DumpFile(memoryFile, name, packageId, packageOffset, hasCompression, decompressedSize, compressedSize, ddsType, chunkIndex != 0, useDDS);
-                    
-                }
-				uint32_t fileId = memoryFile.Read<uint32_t>();
+                });
             }
-
-            if (ch & 8) //if (flag1)
+            pool.Wait();
+        }
+        else
+        {
+            for (const WorkItem &item : items)
             {
-                auto ch3 = memoryFile.Read<uint8_t>();
-                readVariadicInteger(memoryFile, ch3);
+                pool.Submit([&, item]
+                {
+                    IoTuner::Slot worker(tuner.get(), IoTuner::Workers);
+                    extract(item, nullptr, 0);
+                });
             }
+            pool.Wait();
         }
-        else //search tree entry
-        {
-            uint32_t offset = memoryFile.Read<uint32_t>();
-            ParseNames(memoryFile, name);
 
-			memoryFile.Seek(offset);
-            ParseNames(memoryFile, name);
+        if (manifest)
+        {
+            PathString manifestPath = options.outputDir + NativePath("shard-" + std::to_string(options.shard + 1) + "-of-" +
+                std::to_string(options.shardCount) + ".manifest");
+            manifest->Write(manifestPath);
+            PrintLine(PATH_TEXT("Manifest: ") + manifestPath);
         }
     }
-};
 
-std::wstring sdfTocFile;
-std::wstring outputDir;
-DataArray<SdfDdsHeader> ddsHeaderBlock;
-uint16_t lastPackageId = 0xFFFF;
-BlockPtr fileBlock = nullptr;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::stringstream ss;
+    ss << "Extracted " << extractor.ExtractedAssets() << " assets, " << (extractor.ExtractedBytes() >> 20) << " MiB in "
+        << seconds << " s (" << (extractor.ExtractedBytes() / 1048576.0 / std::max(seconds, 1e-6)) << " MiB/s)";
+    if (journal)
+        ss << ", " << extractor.SkippedAssets() << " finished before";
+    PrintLine(ss.str());
+}
 
-void DumpFile(File& memoryFile, const std::string& name,
-	uint16_t packageId, uint64_t packageOffset,
-	bool hasCompression, uint64_t decompressedSize, uint64_t compressedSize,
-	uint64_t ddsType, bool append, bool useDDS)
+// Shard manifests into one, with a warning for every shard missing or listed twice
+// and for every file more than one shard extracted
+void RunMerge(const PathString &mergedPath, const std::vector<PathString> &shardPaths)
 {
-	if (packageId != lastPackageId)
-	{
-		boost::filesystem::path sdfTocPath(sdfTocFile);
-		std::wstring layer = L"A";
-		layer[0] += size_t(packageId / 1000);
-		typedef  boost::basic_format<wchar_t >  wformat;
-		std::wstring dataFormated = boost::str(boost::wformat(L"-%s-%04i.sdfdata") % layer % packageId);
-		std::wstring sdfDataPath = sdfTocPath.parent_path().append(sdfTocPath.stem().wstring()).wstring() + dataFormated;
-		if (!IsFileExist(sdfDataPath))
-		{
-			std::wcout << L"!!!Error: Can't open the file: " << sdfDataPath << std::endl;
-			uint16_t lastPackageId = 0xFFFF;
-			BlockPtr fileBlock = nullptr;
-			return;
-		}
-
-		fileBlock = MakeBlockDisk(sdfDataPath);
-		if (fileBlock->Size() <= 5)
-		{
-			// Skip 'Dummy' file
-			fileBlock = nullptr;
-			return;
-		}
-		std::wcout << L"Open file: " << sdfDataPath << std::endl;
-		lastPackageId = packageId;
-	}
-
-	// Don't override exist file
-	std::wstring outFileName = outputDir + AnsiToUnicode(name);
-	std::replace(outFileName.begin(), outFileName.end(), L'/', L'\\');
-	if (IsFileExist(outFileName) && !append)
-	{
-		std::wcout << L"!!!Error: File is exist: " << outFileName << std::endl;
-		return;
-	}
-	CreateDirectoryRecursively(ExtractFilePath(outFileName));
-	std::wstring strExtract = append ?  L"+++++++ asset: " : L"Extract asset: ";
-	std::wcout << strExtract << outFileName << "\n";
-
-	std::vector<uint64_t> compSizeArray;
-	if (hasCompression)
-	{
-		//uint64_t pageCount = (decompressedSize + 0xffff) >> 16;
-		size_t pageCount = (decompressedSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
-		if (pageCount > 1)
-		{
-			for (size_t page = 0; page < pageCount; page++)
-			{
-				uint16_t compSize = memoryFile.Read<uint16_t>();
-				compSizeArray.push_back(compSize);
-			}
-		}
-		else if (pageCount == 1)
-		{
-			compSizeArray.push_back(compressedSize);
-		}
-	}
-
-	BlockPtr resultBlock;
-	if (!hasCompression)
-	{
-		// uncompressed data
-		try
-		{
-			resultBlock = MakeBlockPart(fileBlock, packageOffset, decompressedSize);
-		}
-		catch (const std::exception& ex)
-		{
-			std::cout << "!!!Error: call MakeBlockPart. Exception: " << ex.what() << std::endl;
-			return;
-		}
-	}
-	else
-	{
-		// need decompress
-		std::unique_ptr<uint8_t[]> decompressed = std::make_unique<uint8_t[]>(decompressedSize);
-		if (compSizeArray.size() == 1)
-		{
-			size_t sizeCompressed = compSizeArray[0];
-			auto dataCompressed = fileBlock->Get<uint8_t>(packageOffset, sizeCompressed);
-			size_t dSize = ZSTD_decompress(decompressed.get(), decompressedSize, dataCompressed.get(), sizeCompressed);
-			if (dSize != decompressedSize)
-			{
-				//throw std::exception("Uncompress error");
-				std::cout << "!!!Error: Uncompress error!!!\n";
-				return;
-			}
-		}
-		else
-		{
-			uint64_t decompOffset = 0;
-			uint64_t compOffset = 0;
-			uint64_t MySize = decompressedSize;
-			size_t chunkSize = CHUNK_SIZE;
-			for (uint64_t compSizePart : compSizeArray)
-			{
-				if (MySize < chunkSize)
-				{
-					chunkSize = MySize;
-				}
-
-				if (compSizePart == 0 || compSizePart >= chunkSize)
-				{
-					fileBlock->Get<uint8_t>(decompressed.get() + decompOffset, packageOffset, chunkSize);
-					packageOffset += chunkSize;
-					decompOffset += chunkSize;
-				}
-				else
-				{
-					auto dataCompressed = fileBlock->Get<uint8_t>(packageOffset, compSizePart);
-					size_t dSize = ZSTD_decompress(decompressed.get() + decompOffset, chunkSize, dataCompressed.get(), compSizePart);
-					if (dSize != chunkSize)
-					{
-						//throw std::exception("Uncompress error");
-						std::cout << "!!!Error: Uncompress error!!!\n";
-						return;
-					}
-					packageOffset += compSizePart;
-					decompOffset += chunkSize;
-				}
-				MySize -= chunkSize;
-			}
-		}
-
-		try
-		{
-			resultBlock = MakeBlockMemory(std::move(decompressed), decompressedSize);
-		}
-		catch (const std::exception& ex2)
-		{
-			std::cout << "!!!Error:" << ex2.what() << "!!!\n";
-			return;
-		}
-	}
-
-	if (useDDS)
-	{
-		SdfDdsHeader ddsHeader = ddsHeaderBlock[ddsType];
-		const int ddsHeaderDataSize = ddsHeader.usedBytes;
-		auto fullDataBlockSize = ddsHeaderDataSize + resultBlock->Size();
-		auto fullDataBlock = std::make_unique<uint8_t[]>(fullDataBlockSize);
-		std::memcpy(fullDataBlock.get(), ddsHeader.bytes, ddsHeaderDataSize);
-		resultBlock->Get(fullDataBlock.get() + ddsHeaderDataSize, 0, resultBlock->Size());
-		try
-		{
-			resultBlock = MakeBlockMemory(std::move(fullDataBlock), fullDataBlockSize);
-		}
-		catch (const std::exception& ex2)
-		{
-			std::cout << "!!!Error: " << ex2.what() << "!!!\n";
-			return;
-		}
-	}
-
-	if (append)
-	{
-		WriteBlockApp(resultBlock, outFileName);
-	}
-	else
-	{
-		WriteBlock(resultBlock, outFileName);
-	}
+    Manifest merged(1, 1);
+    size_t shardCount = 0;
+    std::vector<size_t> seen;
+    for (const PathString &shardPath : shardPaths)
+    {
+        Manifest shard(shardPath);
+        if (shardCount == 0)
+        {
+            shardCount = shard.ShardCount();
+            seen.assign(shardCount + 1, 0);
+        }
+        if (shard.ShardCount() != shardCount || shard.Shard() == 0 || shard.Shard() > shardCount)
+            throw std::runtime_error("Manifests come from different shard counts");
+        seen[shard.Shard()]++;
+        merged.Add(shard);
+    }
+    for (size_t i = 1; i <= shardCount; i++)
+    {
+        if (seen[i] != 1)
+            PrintLine("!!!Warning: shard " + std::to_string(i) + "/" + std::to_string(shardCount) + " is listed " + std::to_string(seen[i]) + " times");
+    }
 
+    merged.Write(mergedPath);
+    const std::vector<ManifestEntry> &entries = merged.Entries();
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        bytes += entries[i].bytes;
+        if (i > 0 && entries[i].name == entries[i - 1].name)
+            PrintLine("!!!Warning: extracted by more than one shard: " + entries[i].name);
+    }
+    std::stringstream ss;
+    ss << "Merged " << shardPaths.size() << " manifests: " << entries.size() << " files, " << (bytes >> 20) << " MiB";
+    PrintLine(ss.str());
 }
 
-
-int wmain(int argc, wchar_t* argv[])
+// list and stats only parse the tocs, no package is opened. The table goes to stdout, errors to stderr.
+bool RunListing(int argc, PathChar* argv[])
 {
-    if (argc != 3)
+    bool stats = PathString(argv[1]) == PATH_TEXT("stats");
+    ListFormat format = ListFormatCsv;
+    Options options;
+    for (int i = 2; i < argc; i++)
     {
-        std::cout << "Mario + Rabbids Kingdom Battle .sdftoc extractor" << std::endl;
-        std::cout << "usage: rouge_sdf.exe <.sdftoc path> <output directory>" << std::endl;
-        return 0;
+        PathString arg = argv[i];
+        if (arg == PATH_TEXT("--format") && i + 1 < argc)
+        {
+            PathString name = argv[++i];
+            if (name != PATH_TEXT("csv") && name != PATH_TEXT("json"))
+                return false;
+            format = name == PATH_TEXT("json") ? ListFormatJson : ListFormatCsv;
+        }
+        else if (arg == PATH_TEXT("--threads") && i + 1 < argc)
+        {
+            options.threadCount = std::max(std::stoul(argv[++i]), 1ul);
+        }
+        else if (arg.compare(0, 2, PATH_TEXT("--")) == 0)
+        {
+            return false;
+        }
+        else
+        {
+            AddTocInput(options, arg);
+        }
     }
+    if (options.tocFiles.empty())
+        return false;
 
-    try
+    std::vector<std::unique_ptr<SdfArchive>> archives(options.tocFiles.size());
     {
+        WorkerPool pool(options.threadCount);
+        unsigned forkDepth = ForkDepth(options.threadCount, options.tocFiles.size());
+        for (size_t i = 0; i < options.tocFiles.size(); i++)
+        {
+            pool.Submit([&, i]
+            {
+                try
+                {
+                    archives[i].reset(new SdfArchive(options.tocFiles[i]));
+                    archives[i]->Parse(forkDepth);
+                }
+                catch (const std::exception & ex)
+                {
+                    PrintError("Error: " + boost::filesystem::path(options.tocFiles[i]).string() + ": " + ex.what());
+                    archives[i].reset();
+                }
+            });
+        }
+        pool.Wait();
+    }
 
-        sdfTocFile = argv[1];
-        outputDir = argv[2];
-
-        outputDir = boost::filesystem::path(outputDir).remove_trailing_separator().wstring() + L"\\";
+    std::vector<const SdfArchive*> parsed;
+    for (const std::unique_ptr<SdfArchive> &archive : archives)
+    {
+        if (archive)
+            parsed.push_back(archive.get());
+    }
+    if (stats)
+        WriteStats(std::cout, parsed, format);
+    else
+        WriteList(std::cout, parsed, format);
+    std::cout.flush();
+    return true;
+}
 
-        auto file = MakeFileDisk(sdfTocFile);
 
-        SdfTocHeader header = file.Read<SdfTocHeader>();
-        SdfTocId id = file.Read<SdfTocId>();
-        uint8_t signExistFlag = file.Read<uint8_t>();
-        if (signExistFlag)
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+#else
+int main(int argc, char* argv[])
+#endif
+{
+    try
+    {
+        if (argc > 1 && PathString(argv[1]) == PATH_TEXT("merge"))
         {
-            file.Seek(0x140, FileOriginCurrent);
+            if (argc < 4)
+            {
+                PrintUsage();
+                return 0;
+            }
+            RunMerge(argv[2], std::vector<PathString>(argv + 3, argv + argc));
+            return 0;
         }
 
-        auto block1 = file.Array<uint32_t>(header.block1count);
-        auto SdfTocIdBlock = file.Array<SdfTocId>(header.block1count);
-        ddsHeaderBlock = file.Array<SdfDdsHeader>(header.ddsHeaderBlockCount);
-        // display all dds header info:
-        std::cout << "\nFound dds header infos:\n";
-        for (size_t ddsIdx = 0; ddsIdx < ddsHeaderBlock.Size(); ++ddsIdx)
-        {
-            const SdfDdsHeader& DDSHeader = ddsHeaderBlock[ddsIdx];
-            std::cout << "[" << ddsIdx << "] Header Size = " << DDSHeader.usedBytes << std::endl;
-#if 0
-			std::wstring ddsHeaderFile = boost::str(boost::wformat(L"%s_DDSHeader/%d.dat") % outputDir % ddsIdx);
-			std::replace(ddsHeaderFile.begin(), ddsHeaderFile.end(), L'/', L'\\');
-			CreateDirectoryRecursively(ExtractFilePath(ddsHeaderFile));
-            auto headerBlock = MakeBlockMemory(DDSHeader.bytes, DDSHeader.usedBytes);
-            WriteBlock(headerBlock, ddsHeaderFile);
-#endif
+        if (argc > 1 && (PathString(argv[1]) == PATH_TEXT("list") || PathString(argv[1]) == PATH_TEXT("stats")))
+        {
+            if (!RunListing(argc, argv))
+                PrintUsage();
+            return 0;
         }
 
-        // find the compressed bulk data
-        size_t CompressDataOffset = file.Size() - 0x30 - header.compressedSize;
-        file.Seek(CompressDataOffset);
-        std::unique_ptr<uint8_t[]> decompressed = std::make_unique<uint8_t[]>(header.decompressedSize);
-        std::unique_ptr<uint8_t[]> compressed = std::make_unique<uint8_t[]>(header.compressedSize);
+        Options options;
+        if (!ParseOptions(argc, argv, options) || options.tocFiles.empty())
+        {
+            PrintUsage();
+            return 0;
+        }
 
-        file.Read<uint8_t>(compressed.get(), header.compressedSize);
-        // use zstd method
-        size_t decompSize = ZSTD_decompress(decompressed.get(), header.decompressedSize, compressed.get(), header.compressedSize);
-        File memoryFile = File(MakeBlockMemory(std::move(decompressed), decompSize));
-        
-        FileTree::ParseNames(memoryFile);
+        RunExtraction(options);
     }
     catch (const std::exception & ex)
     {
         std::cout << "Error: " << ex.what() << std::endl;
     }
     return 0;
-}
\ No newline at end of file
+}
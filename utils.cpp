@@ -4,6 +4,8 @@
 #include <Shlobj.h>
 #include <unordered_map>
 #include <memory>
+#include <algorithm>
+#include <mutex>
 
 
 std::vector<std::wstring> EnumerateDirectory(const std::wstring &directory, const std::wstring &filter)
@@ -135,6 +137,19 @@ std::wstring AnsiToUnicode(const std::string &string)
     return result;
 }
 
+std::wstring NativePath(const std::string &name)
+{
+    std::wstring path = AnsiToUnicode(name);
+    std::replace(path.begin(), path.end(), L'/', L'\\');
+    return path;
+}
+
+bool SyncFileSystem(const std::wstring &path)
+{
+    // flushing a whole volume needs administrator rights, callers flush their files one by one instead
+    return false;
+}
+
 unsigned long long FileSize(const std::wstring &fileName)
 {
     std::ifstream f(fileName, std::ios::binary);
@@ -142,4 +157,174 @@ unsigned long long FileSize(const std::wstring &fileName)
     if (!f.good())
         throw std::exception("Cannot get file size");
     return f.tellg();
-}
\ No newline at end of file
+}
+
+static std::mutex printMutex;
+
+void PrintLine(const std::wstring &line)
+{
+    std::lock_guard<std::mutex> lock(printMutex);
+    std::wcout << line << L"\n";
+}
+
+void PrintLine(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(printMutex);
+    std::cout << line << "\n";
+}
+
+void PrintError(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(printMutex);
+    std::cerr << line << std::endl;
+}
+
+MappedFile::MappedFile(const std::wstring &fileName)
+    : file_(INVALID_HANDLE_VALUE)
+    , mapping_(nullptr)
+    , data_(nullptr)
+    , size_(0)
+{
+    file_ = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw std::exception("Cannot open file for mapping");
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file_, &fileSize))
+    {
+        Close();
+        throw std::exception("Cannot get file size");
+    }
+    size_ = fileSize.QuadPart;
+    if (size_ == 0)
+        return; // empty files can't be mapped
+
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_)
+        data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!data_)
+    {
+        Close();
+        throw std::exception("Cannot map file");
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+void MappedFile::Close()
+{
+    if (data_)
+        UnmapViewOfFile(data_);
+    if (mapping_)
+        CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    data_ = nullptr;
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+
+OutputFile::OutputFile(const std::wstring &fileName, bool append)
+{
+    file_ = CreateFileW(fileName.c_str(), append ? FILE_APPEND_DATA : GENERIC_WRITE, 0, nullptr,
+        append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw std::exception("Failed to open file for writing");
+}
+
+OutputFile::~OutputFile()
+{
+    CloseHandle(file_);
+}
+
+void OutputFile::Write(const std::vector<DataSpan> &spans)
+{
+    // WriteFileGather needs sector aligned buffers, so the spans go out back to back on one handle
+    for (const DataSpan &span : spans)
+    {
+        const unsigned char *data = span.data;
+        uint64_t left = span.size;
+        while (left)
+        {
+            DWORD part = left > 0x40000000 ? 0x40000000 : DWORD(left);
+            DWORD written = 0;
+            if (!WriteFile(file_, data, part, &written, nullptr) || written != part)
+                throw std::exception("Failed to write file");
+            data += part;
+            left -= part;
+        }
+    }
+}
+
+void OutputFile::Sync()
+{
+    if (!FlushFileBuffers(file_))
+        throw std::exception("Failed to flush file");
+}
+
+void OutputFile::CopyFrom(InputFile &source, uint64_t offset, uint64_t size)
+{
+    // no kernel side copy between plain handles, the range goes through a buffer
+    const size_t bufferSize = 1 << 20;
+    std::unique_ptr<unsigned char[]> buffer(size ? new unsigned char[bufferSize] : nullptr);
+    while (size)
+    {
+        size_t part = size_t(std::min<uint64_t>(size, bufferSize));
+        source.ReadAt(buffer.get(), offset, part);
+        Write({ DataSpan{ buffer.get(), part } });
+        offset += part;
+        size -= part;
+    }
+}
+
+
+InputFile::InputFile(const std::wstring &fileName)
+{
+    file_ = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw std::exception("File open error");
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file_, &fileSize))
+    {
+        CloseHandle(file_);
+        throw std::exception("Cannot get file size");
+    }
+    size_ = fileSize.QuadPart;
+}
+
+InputFile::~InputFile()
+{
+    CloseHandle(file_);
+}
+
+void InputFile::ReadAt(void *data, uint64_t offset, size_t size)
+{
+    if (offset + size > size_)
+        throw std::exception("Going beyond file");
+
+    // the offset travels with every request, so threads never race on a file pointer
+    unsigned char *dst = static_cast<unsigned char*>(data);
+    while (size)
+    {
+        DWORD part = size > 0x40000000 ? 0x40000000 : DWORD(size);
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(file_, dst, part, &read, &overlapped) || read != part)
+            throw std::exception("File read error");
+        dst += part;
+        offset += part;
+        size -= part;
+    }
+}
+
+void InputFile::WillNeed(uint64_t offset, uint64_t size)
+{
+    // plain handles have no readahead hint on Win32, the cache manager's own readahead has to do
+}
@@ -7,24 +7,121 @@
 #include <iostream>
 #include <vector>
 
-std::vector<std::wstring> EnumerateDirectory(const std::wstring &directory, const std::wstring &filter = L"*");
+// Paths are UTF-16 on Windows and native narrow (UTF-8) strings everywhere else
+#ifdef _WIN32
+typedef wchar_t PathChar;
+#define PATH_TEXT(x) L##x
+#define PATH_SEPARATOR L'\\'
+#else
+typedef char PathChar;
+#define PATH_TEXT(x) x
+#define PATH_SEPARATOR '/'
+#endif
+typedef std::basic_string<PathChar> PathString;
 
-std::wstring ExtractFilePath(const std::wstring &file_name);
-std::wstring ExtractFileName(const std::wstring &file_name);
+std::vector<PathString> EnumerateDirectory(const PathString &directory, const PathString &filter = PATH_TEXT("*"));
 
+PathString ExtractFilePath(const PathString &file_name);
+PathString ExtractFileName(const PathString &file_name);
 
-std::wstring Number(uint64_t i);
 
-void WriteData(const std::wstring &name, const unsigned char *data, uint64_t dataSize);
-void WriteDataApp(const std::wstring &name, const unsigned char *data, uint64_t dataSize);
+PathString Number(uint64_t i);
 
-bool IsFileExist(const std::wstring & fileName);
+void WriteData(const PathString &name, const unsigned char *data, uint64_t dataSize);
+void WriteDataApp(const PathString &name, const unsigned char *data, uint64_t dataSize);
 
-void CreateLinkByPath(const std::wstring &newName, const std::wstring &existingName);
+bool IsFileExist(const PathString & fileName);
 
-int CreateDirectoryRecursively(const std::wstring &path);
+void CreateLinkByPath(const PathString &newName, const PathString &existingName);
 
+int CreateDirectoryRecursively(const PathString &path);
+
+#ifdef _WIN32
 std::string UnicodeToAnsi(const std::wstring &string);
 std::wstring AnsiToUnicode(const std::string &string);
+#endif
+
+// Archive and list file names to a native path, '/' becomes PATH_SEPARATOR
+PathString NativePath(const std::string &name);
+
+unsigned long long FileSize(const PathString &fileName);
+
+// Flushes every file written so far on the file system holding path, false where that isn't possible
+bool SyncFileSystem(const PathString &path);
+
+// Whole line to the console, lines from different threads don't interleave
+#ifdef _WIN32
+void PrintLine(const std::wstring &line);
+#endif
+void PrintLine(const std::string &line);
+// Whole line to stderr, under the same lock as PrintLine
+void PrintError(const std::string &line);
+
+// Read-only view of a whole file mapped into memory
+class MappedFile
+{
+public:
+    explicit MappedFile(const PathString &fileName);
+    ~MappedFile();
+    const unsigned char *Data() const { return data_; }
+    uint64_t Size() const { return size_; }
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    void Close();
+#ifdef _WIN32
+    void *file_;
+    void *mapping_;
+#endif
+    const unsigned char *data_;
+    uint64_t size_;
+};
+
+// Package file opened once and read at explicit offsets, safe to share between threads
+class InputFile
+{
+public:
+    explicit InputFile(const PathString &fileName);
+    ~InputFile();
+    uint64_t Size() const { return size_; }
+    void ReadAt(void *data, uint64_t offset, size_t size);
+    // range is going to be read soon, the OS may start fetching it
+    void WillNeed(uint64_t offset, uint64_t size);
+private:
+    friend class OutputFile;
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+#ifdef _WIN32
+    void *file_;
+#else
+    int fd_;
+#endif
+    uint64_t size_;
+};
+
+struct DataSpan
+{
+    const unsigned char *data;
+    uint64_t size;
+};
 
-unsigned long long FileSize(const std::wstring &fileName);
\ No newline at end of file
+// Output file written with lists of buffers, so prefixes never need to be glued to payloads
+class OutputFile
+{
+public:
+    OutputFile(const PathString &fileName, bool append);
+    ~OutputFile();
+    void Write(const std::vector<DataSpan> &spans);
+    // appends size bytes of source from offset on, inside the kernel where the OS can
+    void CopyFrom(InputFile &source, uint64_t offset, uint64_t size);
+    // what was written is on disk when this returns
+    void Sync();
+private:
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+#ifdef _WIN32
+    void *file_;
+#else
+    int fd_;
+#endif
+};
\ No newline at end of file
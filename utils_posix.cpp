@@ -0,0 +1,423 @@
+#include "utils.h"
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+std::vector<std::string> EnumerateDirectory(const std::string &directory, const std::string &filter)
+{
+    std::vector<std::string> res;
+    DIR *dir = opendir(directory.c_str());
+    if (dir)
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            if (fnmatch(filter.c_str(), entry->d_name, 0) == 0)
+                res.push_back(directory + entry->d_name);
+        }
+        closedir(dir);
+    }
+    return res;
+}
+
+
+std::string ExtractFilePath(const std::string &file_name)
+{
+    const size_t last_slash_idx = file_name.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        return file_name.substr(0, last_slash_idx + 1);
+    }
+    else
+    {
+        return "./";
+    }
+}
+std::string ExtractFileName(const std::string &file_name)
+{
+    const size_t last_slash_idx = file_name.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        return file_name.substr(last_slash_idx + 1, -1);
+    }
+    else
+    {
+        return file_name;
+    }
+}
+
+static std::mutex directoryMutex;
+static std::unordered_set<std::string> knownDirectories;
+
+// Creates the missing tail of the path with mkdirat/openat relative to the deepest directory
+// already known to exist, so neither the kernel nor we re-walk the full path for every level.
+int CreateDirectoryRecursively(const std::string &path)
+{
+    std::string directory = path;
+    while (directory.size() > 1 && directory.back() == '/')
+        directory.pop_back();
+    if (directory.empty())
+        return 0;
+
+    size_t known = 0;
+    {
+        std::lock_guard<std::mutex> lock(directoryMutex);
+        if (knownDirectories.count(directory))
+            return 0;
+        for (size_t pos = directory.rfind('/'); pos != std::string::npos && pos > 0; pos = directory.rfind('/', pos - 1))
+        {
+            if (knownDirectories.count(directory.substr(0, pos)))
+            {
+                known = pos;
+                break;
+            }
+        }
+    }
+
+    int dirFd = AT_FDCWD;
+    if (known)
+        dirFd = open(directory.substr(0, known).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else if (directory[0] == '/')
+        dirFd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0 && dirFd != AT_FDCWD)
+        return errno;
+
+    int error = 0;
+    std::vector<std::string> created;
+    size_t begin = known;
+    while (begin < directory.size())
+    {
+        size_t end = directory.find('/', begin);
+        if (end == std::string::npos)
+            end = directory.size();
+        std::string component = directory.substr(begin, end - begin);
+        begin = end + 1;
+        if (component.empty())
+            continue;
+
+        if (mkdirat(dirFd, component.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            error = errno;
+            break;
+        }
+        int nextFd = openat(dirFd, component.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (nextFd < 0)
+        {
+            error = errno;
+            break;
+        }
+        if (dirFd != AT_FDCWD)
+            close(dirFd);
+        dirFd = nextFd;
+        created.push_back(directory.substr(0, end));
+    }
+    if (dirFd != AT_FDCWD)
+        close(dirFd);
+
+    if (!error)
+    {
+        std::lock_guard<std::mutex> lock(directoryMutex);
+        knownDirectories.insert(created.begin(), created.end());
+    }
+    return error;
+}
+
+void CreateLinkByPath(const std::string &newName, const std::string &existingName)
+{
+    CreateDirectoryRecursively(ExtractFilePath(newName));
+    unlink(newName.c_str());
+
+    if (link(existingName.c_str(), newName.c_str()) != 0)
+    {
+        std::ifstream src(existingName, std::ios::binary);
+        std::ofstream dst(newName, std::ios::binary);
+        dst << src.rdbuf();
+    }
+}
+
+
+std::string Number(uint64_t i)
+{
+    return std::to_string(i);
+}
+
+
+void WriteData(const std::string &name, const unsigned char *data, uint64_t data_size)
+{
+    CreateDirectoryRecursively(ExtractFilePath(name));
+    std::ofstream s(name, std::ios::binary);
+    s.write((const char*) data, data_size);
+    if (!s.good())
+    {
+        throw std::runtime_error("Failed to write file");
+    }
+    std::cout << ">" << name << std::endl;
+}
+
+void WriteDataApp(const std::string &name, const unsigned char *data, uint64_t data_size)
+{
+    std::ofstream s(name, std::ios::binary | std::ios::app);
+    s.write((const char*) data, data_size);
+    if (!s.good())
+    {
+        throw std::runtime_error("Failed to write file");
+    }
+}
+
+bool IsFileExist(const std::string & fileName)
+{
+    return access(fileName.c_str(), F_OK) == 0;
+}
+
+std::string NativePath(const std::string &name)
+{
+    // archive names already use '/' and are passed through as UTF-8
+    return name;
+}
+
+unsigned long long FileSize(const std::string &fileName)
+{
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0)
+        throw std::runtime_error("Cannot get file size");
+    return st.st_size;
+}
+
+bool SyncFileSystem(const std::string &path)
+{
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool synced = syncfs(fd) == 0;
+    close(fd);
+    return synced;
+#else
+    sync();
+    return true;
+#endif
+}
+
+static std::mutex printMutex;
+
+void PrintLine(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(printMutex);
+    std::cout << line << "\n";
+}
+
+void PrintError(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(printMutex);
+    std::cerr << line << std::endl;
+}
+
+MappedFile::MappedFile(const std::string &fileName)
+    : data_(nullptr)
+    , size_(0)
+{
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open file for mapping");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot get file size");
+    }
+    size_ = st.st_size;
+    if (size_ != 0)
+    {
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot map file");
+        }
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const unsigned char*>(data);
+    }
+    // the mapping keeps the file referenced
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+void MappedFile::Close()
+{
+    if (data_)
+        munmap(const_cast<unsigned char*>(data_), size_);
+    data_ = nullptr;
+}
+
+OutputFile::OutputFile(const std::string &fileName, bool append)
+{
+    // no O_APPEND: copy_file_range refuses such targets, the position is moved to the end instead
+    fd_ = open(fileName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    if (fd_ < 0)
+        throw std::runtime_error("Failed to open file for writing");
+    if (append && lseek(fd_, 0, SEEK_END) < 0)
+    {
+        close(fd_);
+        throw std::runtime_error("Failed to open file for writing");
+    }
+}
+
+OutputFile::~OutputFile()
+{
+    close(fd_);
+}
+
+void OutputFile::Write(const std::vector<DataSpan> &spans)
+{
+    std::vector<iovec> iov;
+    iov.reserve(spans.size());
+    for (const DataSpan &span : spans)
+    {
+        if (span.size)
+            iov.push_back(iovec{ const_cast<unsigned char*>(span.data), size_t(span.size) });
+    }
+
+    size_t first = 0;
+    while (first < iov.size())
+    {
+        int count = int(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t written = writev(fd_, &iov[first], count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw std::runtime_error("Failed to write file");
+
+        // drop what went out, a short write may stop in the middle of a span
+        size_t left = size_t(written);
+        while (first < iov.size() && left >= iov[first].iov_len)
+        {
+            left -= iov[first].iov_len;
+            first++;
+        }
+        if (left)
+        {
+            iov[first].iov_base = static_cast<unsigned char*>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+        }
+    }
+}
+
+void OutputFile::Sync()
+{
+    if (fdatasync(fd_) != 0)
+        throw std::runtime_error("Failed to flush file");
+}
+
+void OutputFile::CopyFrom(InputFile &source, uint64_t offset, uint64_t size)
+{
+    if (offset + size > source.size_)
+        throw std::runtime_error("Going beyond file");
+
+#ifdef __linux__
+    // the bytes stay in the page cache, filesystems with reflinks or server side copy share the extents instead
+    while (size)
+    {
+        loff_t from = loff_t(offset);
+        ssize_t copied = copy_file_range(source.fd_, &from, fd_, nullptr, size_t(std::min<uint64_t>(size, 1 << 30)), 0);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0)
+            break;
+        offset += copied;
+        size -= copied;
+    }
+    // older kernels refuse copy_file_range across filesystems, sendfile still copies in the kernel
+    while (size)
+    {
+        off_t from = off_t(offset);
+        ssize_t copied = sendfile(fd_, source.fd_, &from, size_t(std::min<uint64_t>(size, 1 << 30)));
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0)
+            break;
+        offset += copied;
+        size -= copied;
+    }
+#endif
+
+    // whatever the kernel wouldn't copy goes through a buffer
+    const size_t bufferSize = 1 << 20;
+    std::unique_ptr<unsigned char[]> buffer(size ? new unsigned char[bufferSize] : nullptr);
+    while (size)
+    {
+        size_t part = size_t(std::min<uint64_t>(size, bufferSize));
+        source.ReadAt(buffer.get(), offset, part);
+        Write({ DataSpan{ buffer.get(), part } });
+        offset += part;
+        size -= part;
+    }
+}
+
+InputFile::InputFile(const std::string &fileName)
+{
+    fd_ = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+        throw std::runtime_error("File open error");
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+    {
+        close(fd_);
+        throw std::runtime_error("Cannot get file size");
+    }
+    size_ = st.st_size;
+    // assets are laid out back to back and mostly read front to back: ask for the larger readahead window
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+InputFile::~InputFile()
+{
+    close(fd_);
+}
+
+void InputFile::ReadAt(void *data, uint64_t offset, size_t size)
+{
+    if (offset + size > size_)
+        throw std::runtime_error("Going beyond file");
+
+    unsigned char *dst = static_cast<unsigned char*>(data);
+    while (size)
+    {
+        ssize_t read = pread(fd_, dst, size, off_t(offset));
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+            throw std::runtime_error("File read error");
+        dst += read;
+        offset += read;
+        size -= read;
+    }
+}
+
+void InputFile::WillNeed(uint64_t offset, uint64_t size)
+{
+    posix_fadvise(fd_, off_t(offset), off_t(size), POSIX_FADV_WILLNEED);
+}